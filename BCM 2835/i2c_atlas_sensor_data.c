@@ -15,6 +15,14 @@
  */
 #define del 100 
 
+/*
+ * Define the time the sensor needs to answer the "i" command and to clear its calibration.
+ * All the sensors are sent the command first and the delay is waited once for all of them.
+ * Time is in milli second.
+ */
+#define info_del 300
+#define clear_del 300
+
 /*
  * Global time used to read system clock
  */
@@ -50,30 +58,49 @@ static void setUp_addr_c(){
 
 /*
  * Clears the sensor of previous calibration or setting.
+ * Does not wait for the sensor. Wait clear_del once after clearing all the sensors.
  */
 static void clearSensor(){
-	char clear[] = "cal,clear ";
-	bcm2835_i2c_write(clear, 32);
-	delay(1000);
-	printf("Data has been cleared. Start Reading\n");
-	delay(1000);
+	char clear[] = "cal,clear";
+	bcm2835_i2c_write(clear, sizeof(clear) - 1);
+}
+
+/*
+ * Asks the sensor what it is with the "i" command.
+ * Does not wait for the sensor. Wait info_del once after asking all the sensors, then check_info() each of them.
+ */ 
+static void ask_info(){
+	char info[] = "i";
+	bcm2835_i2c_write(info, sizeof(info) - 1);
+}
+
+/*
+ * Reads the answer of the sensor to the "i" command : "?I,device,firmware".
+ * Returns 1 if the sensor answered, 0 if it is missing.
+ */ 
+static int check_info(char* name){
+	char result[33] = { 0 };
+	if(bcm2835_i2c_read(result, 32) != BCM2835_I2C_REASON_OK || result[0] != 1){
+		printf("%s sensor is missing\n", name);
+		return 0;
+	}
+	printf("%s sensor : %s\n", name, result + 1);
+	return 1;
 }
 
 /*
  * Writes a request to slave device for one sensor data reading
  */
 static void write_to_I2C(){
-	char current[] = "R ";
-	bcm2835_i2c_write(current, 32);
+	char current[] = "R";
+	bcm2835_i2c_write(current, sizeof(current) - 1);
 }
 
 /*
- * Reads the sensor data of the slave device.
+ * Reads the sensor data of the slave device into result, which holds at least 32 characters.
  */ 
-static char* read_from_I2C(){
-	char* result = (char*) malloc(32 *sizeof(char));
+static void read_from_I2C(char* result){
 	bcm2835_i2c_read(result, 32);
-	return result;
 }
 
 /*
@@ -115,7 +142,8 @@ static void get_ph(FILE *fp){
 	//clearSensor();
 	write_to_I2C();
 	delay(800);
-	char* result = read_from_I2C();
+	char result[33] = { 0 };
+	read_from_I2C(result);
 	int i;
 	if(result[0] == 1){
 		printf("ph Value : ");
@@ -147,7 +175,8 @@ static void get_c(FILE *fp){
 	//clearSensor();
 	write_to_I2C();
 	delay(800);
-	char* result = read_from_I2C();
+	char result[33] = { 0 };
+	read_from_I2C(result);
 	int i;
 	if(result[0] == 1){
 		printf("Conductivity Value : ");
@@ -190,10 +219,22 @@ int main(){
 			return;
 		}
 		bcm2835_i2c_set_baudrate(100000);
+		setUp_addr_ph();
+		ask_info();
+		setUp_addr_c();
+		ask_info();
+		delay(info_del);
+		setUp_addr_ph();
+		check_info("ph");
+		setUp_addr_c();
+		check_info("Conductivity");
+
 		setUp_addr_ph();
 		clearSensor();
 		setUp_addr_c();
 		clearSensor();
+		delay(clear_del);
+		printf("Data has been cleared. Start Reading\n");
 		int i;
 		for(i = 0;i <= 5;i++){
 			get_ph(fp_ph);
@@ -0,0 +1,104 @@
+# encoding=utf8
+"""CPU used by the bridge per record, before and after the daemon builds the payload.
+
+Before, the bridge splits the csv row and encodes the json itself (what
+clientPubSub.py does for a csv record). After, the daemon started with
+-f json or -f binary sends the payload and the bridge forwards it as it is.
+The publish to the cloud is left out, it is the same in both cases.
+
+Offline, the two ways are timed on the same rows built here:
+    python bench_bridge.py [records]
+
+Live, the records of a running daemon are received and handled for a while.
+Run it once with the daemon in csv and once with -f json, with the replay as
+load generator, for example:
+    ./i2c_atlas_sensor_data -R native.log -x 0 -n 50
+    python bench_bridge.py --live 30
+    ./i2c_atlas_sensor_data -R native.log -x 0 -n 50 -f json
+    python bench_bridge.py --live 30
+"""
+import json
+import os
+import sys
+import time
+import zmq
+from sequenced_stream import Record, SequencedSubscriber
+
+# Prefix of the json fields of the fused streams and names of the fields of the raw streams, as in clientPubSub.py.
+FUSED = {'ph': 'ph', 'c': 'c'}
+FIELDS = {'ph_raw': ('ph_data1', 'ph_data2', 'ph_data3'), 'c_raw': ('c_data1', 'c_data2', 'c_data3')}
+
+
+def cpu_time():
+    '''User and system time of the process, in second.'''
+    times = os.times()
+    return times[0] + times[1]
+
+
+def bridge_payload(record):
+    '''The payload the bridge publishes for the record.'''
+    if record.payload[:1] in (b'{', b'\x01'):
+        return record.payload
+    fields = record.body.split(",")
+    date, clock, data1, data2, data3 = fields[:5]
+    temperature = fields[5] if len(fields) > 5 else ''
+    if record.stream in FUSED:
+        prefix = FUSED[record.stream]
+        payload = {prefix + '_data': data1, prefix + '_confidence': data2, prefix + '_sensors': data3}
+    else:
+        prefix = record.stream.split('_')[0]
+        field1, field2, field3 = FIELDS[record.stream]
+        payload = {field1: data1, field2: data2, field3: data3}
+    payload[prefix + '_temperature'] = temperature
+    payload['controller_id'] = record.controller
+    payload['date'] = date
+    payload['time'] = clock
+    return json.dumps(payload)
+
+
+def offline(count):
+    '''Time the bridge on count csv records and on the same records as json payloads.'''
+    csv_records = []
+    json_records = []
+    for i in range(count):
+        stream = 'ph' if i % 2 else 'c'
+        body = '2026-10-19,08:47,{:.3f},0.97,123,20.4'.format(7 + (i % 100) / 100.0)
+        csv_record = Record('C{:03d}'.format(i % 50), stream, 1, i + 1, body.encode('ascii'))
+        csv_records.append(csv_record)
+        json_records.append(Record(csv_record.controller, stream, 1, i + 1,
+                                   bridge_payload(csv_record).encode('ascii')))
+
+    for name, records in (('csv, encoded by the bridge', csv_records), ('json, built by the daemon', json_records)):
+        start = cpu_time()
+        for record in records:
+            bridge_payload(record)
+        used = cpu_time() - start
+        print('{:28s} : {:8.2f} us of cpu per record'.format(name, used * 1e6 / count))
+
+
+def live(seconds):
+    '''Handle the records of the running daemon for the given time and report the cpu used.'''
+    context = zmq.Context()
+    subscriber = SequencedSubscriber(context)
+    subscriber.socket.setsockopt(zmq.RCVTIMEO, 1000)
+    count = 0
+    deadline = time.time() + seconds
+    start = cpu_time()
+    while time.time() < deadline:
+        try:
+            record = subscriber.recv()
+        except zmq.Again:
+            continue
+        if record.stream in FUSED or record.stream in FIELDS:
+            bridge_payload(record)
+            count += 1
+    used = cpu_time() - start
+    print('{} records in {} s, {:.2f} s of cpu, {:.2f} us per record'.format(
+        count, seconds, used, used * 1e6 / count if count else 0))
+
+
+if __name__ == '__main__':
+    if len(sys.argv) > 2 and sys.argv[1] == '--live':
+        live(float(sys.argv[2]))
+    else:
+        offline(int(sys.argv[1]) if len(sys.argv) > 1 else 200000)
@@ -5,9 +5,8 @@ import json
 from google.cloud import pubsub
 import google.auth
 from google.oauth2 import service_account
+from sequenced_stream import SequencedSubscriber
 
-# Controller ID to identify the origin of data.
-CONTROLLER_ID = 'C001'
  
 # Insert pub/sub data
 pubsub_client = pubsub.Client('wioceanbridge')
@@ -15,43 +14,57 @@ topic = pubsub_client.topic('asu-sensory-readings')
 #
 
 
+def on_lost(controller, stream, epoch, first, last):
+	"""Called for the records the publisher no longer keeps."""
+	print("Lost records %d to %d of stream %s/%s epoch %d" % (first, last, controller, stream, epoch))
+
+
 # Start the Client to local host 5556 to get the data stream.
+# Gaps in the stream are filled from the resend side channel on local host 5557.
 context = zmq.Context()
-socket = context.socket(zmq.SUB)
 print("Collecting Information")
-socket.connect("tcp://localhost:5556")
+subscriber = SequencedSubscriber(context, on_lost=on_lost)
 
-filter = ""
-filter = filter.decode('ascii')
-
-# Connect to local host 5556 socket.
-socket.setsockopt_string(zmq.SUBSCRIBE, filter)
+# Names of the json fields of the three columns of the raw streams (-a).
+FIELDS = {'ph_raw': ('ph_data1', 'ph_data2', 'ph_data3'), 'c_raw': ('c_data1', 'c_data2', 'c_data3')}
+# Prefix of the json fields of the fused streams.
+FUSED = {'ph': 'ph', 'c': 'c'}
 
 while True:
-	# Recieve the string in the socket.
-	string1 = socket.recv_string()
-	string2 = socket.recv_string()
+	# Recieve the next record in sequence.
+	# Every sensor has its own period, so the ph and conductivity rows arrive at their own rate.
+	record = subscriber.recv()
+	if record.stream not in FIELDS and record.stream not in FUSED:
+		continue
+
+	# The daemon started with -f json or -f binary builds the payload itself. Forward it as it is.
+	if record.payload[:1] in (b'{', b'\x01'):
+		topic.publish(record.payload)
+		continue
 
-	# Extract the data from the string. 
-	date1, time1, data_ph1, data_ph2, data_ph3 = string1.split(",")
-	date2, time2, data_c1, data_c2, data_c3 = string2.split(",")
+	# Extract the data from the string. Empty values are readings that failed.
+	# The temperature the sensors compensated the readings with is empty if there was none.
+	fields = record.body.split(",")
+	date, time, data1, data2, data3 = fields[:5]
+	temperature = fields[5] if len(fields) > 5 else ''
 
 	# Display the data recieved. (Optional)
-	#print("Date1 : %s , Time1 : %s , data1 : %s , data2 : %s , data3 : %s" %(date1, time1, data_ph1, data_ph2, data_ph3))
-	#print("Date2 : %s , Time2 : %s , data1 : %s , data2 : %s , data3 : %s" %(date2, time2, data_c1, data_c2, data_c3))
+	#print("Stream : %s , Seq : %d , Date : %s , Time : %s , data1 : %s , data2 : %s , data3 : %s" %(record.stream, record.seq, date, time, data1, data2, data3))
 
 	# Create the json file to be send to google pub/sub.
-	json_data = json.dumps({
-				'controller_id':CONTROLLER_ID,
-				'date':date1,
-				'time':time1,
-				'ph_data1':data_ph1,
-				'ph_data2':data_ph2,
-				'ph_data3':data_ph3,
-				'c_data1':data_c1,
-				'c_data2':data_c2,
-				'c_data3':data_c3
-				})
+	# A fused row has the value, its confidence and the columns of the sensors that agree.
+	if record.stream in FUSED:
+		prefix = FUSED[record.stream]
+		fields = {prefix + '_data':data1, prefix + '_confidence':data2, prefix + '_sensors':data3}
+	else:
+		prefix = record.stream.split('_')[0]
+		field1, field2, field3 = FIELDS[record.stream]
+		fields = {field1:data1, field2:data2, field3:data3}
+	fields[prefix + '_temperature'] = temperature
+	fields['controller_id'] = record.controller
+	fields['date'] = date
+	fields['time'] = time
+	json_data = json.dumps(fields)
 	print json_data
 	# Publish the data to google pub/sub.
 	topic.publish(json_data)
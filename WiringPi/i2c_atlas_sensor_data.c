@@ -8,9 +8,12 @@
  */
 
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#ifndef SIMULATED_BUS
 #include <wiringPiI2C.h>
+#endif
 #include <time.h>
 #include <stdint.h>
 #include <fcntl.h>
@@ -21,6 +24,19 @@
 #include <fcntl.h>
 #include <zmq.h>
 #include <assert.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <math.h>
+#include <sched.h>
+#include <signal.h>
+#include <malloc.h>
+#include <sys/mman.h>
+#include <dirent.h>
+
+//The simulated bus of the soak test replaces wiringPi, see simulated_bus.h.
+#ifdef SIMULATED_BUS
+#include "simulated_bus.h"
+#endif
 
 
 /*
@@ -40,170 +56,3382 @@
 
 
 /*
- * Define the delay between each read of a sensor.
+ * The i2c address of the temperature (RTD) sensor of each bus.
+ */
+#define ADDR_T_0 0x67
+#define ADDR_T_1 0x68
+
+
+/*
+ * Define the default period between two readings of a sensor.
  * Time is in milli second.
  */
-#define DEL 57600
+#define PERIOD_PH 60000
+#define PERIOD_C 60000
+
+
+/*
+ * The temperature read by the RTD sensor of a bus is sent to the ph and conductivity sensors of that bus
+ * with their next reading, with the "RT" command. A temperature older than COMPENSATION_MAX_AGE_MS is not used.
+ * A temperature outside RTD_MIN_C and RTD_MAX_C, in degree Celsius, is not sent: -1023 is the reading of an RTD
+ * sensor without its probe. The previous temperature is used until it is too old.
+ */
+#define COMPENSATION_MAX_AGE_MS 300000
+#define RTD_MIN_C -20.0
+#define RTD_MAX_C 100.0
+
+
+/*
+ * A sensor still busy with a command from before the start is asked again with the "i" command up to
+ * INFO_RETRIES times.
+ */
+#define INFO_RETRIES 3
+
+
+/*
+ * Power saving mode, turned on with -s. A sensor is put to sleep after its reading when its next reading is
+ * more than MIN_SLEEP_MS away, and woken up WAKE_MS before it. The events of a bus due within COALESCE_MS of
+ * the first one are run together so that the processor sleeps longer, and a bus worker with nothing due checks
+ * for the end of the collection every POWER_POLL_MS instead of every 100 ms.
+ * Time is in milli second. SUPPLY_V is the supply voltage of the sensors, used to estimate their energy.
+ */
+#define WAKE_MS 300
+#define MIN_SLEEP_MS 2000
+#define COALESCE_MS 30
+#define POWER_POLL_MS 500
+#define SUPPLY_V 3.3
+
+
+/*
+ * Power states of a sensor : awake and idle, taking a reading, asleep.
+ */
+#define POWER_IDLE 0
+#define POWER_READING 1
+#define POWER_ASLEEP 2
+#define POWER_STATES 3
+
+
+/*
+ * A command of the atlas sensor and the time the sensor needs to process it, in milli second.
+ * EZO_CMD gives the length of the command at compile time, so the commands are written as they are
+ * without building or measuring a string.
+ */
+struct EzoCommand {
+	const char *text;
+	int length;
+	int delay_ms;
+};
+
+#define EZO_CMD(text, delay_ms) { text, sizeof(text) - 1, delay_ms }
+
+
+/*
+ * A calibration point of an atlas sensor. name and solution are shown to the user,
+ * solution is NULL if the point does not need a calibration solution.
+ */
+struct EzoCalPoint {
+	const char *name;
+	const char *solution;
+	struct EzoCommand command;
+};
+
+
+/*
+ * Description of a type of atlas EZO sensor.
+ * device is the answer of the sensor to the "i" command, as written in its data sheet ("D.O." for the dissolved
+ * oxygen sensor), and label the name shown to the user.
+ * compensate is the start of the reading command with temperature compensation, followed by the temperature,
+ * or NULL if the sensor does not use the temperature.
+ * current_ma is the current the sensor draws in every power state, in milli ampere at SUPPLY_V. The values are
+ * the ones of the data sheets, replace them with measured ones for a better estimate of the energy.
+ * fields and units name the comma separated fields of a reading. The first one is the value that is published.
+ * cal is the list of the calibration points in the order they are done, after clear.
+ */
+#define EZO_MAX_FIELDS 4
+#define EZO_MAX_CAL_POINTS 3
+
+struct EzoDescriptor {
+	const char *device;
+	const char *label;
+	struct EzoCommand read;
+	struct EzoCommand info;
+	struct EzoCommand clear;
+	struct EzoCommand sleep;
+	const char *compensate;
+	float current_ma[POWER_STATES];
+	int field_count;
+	const char *fields[EZO_MAX_FIELDS];
+	const char *units[EZO_MAX_FIELDS];
+	int cal_count;
+	struct EzoCalPoint cal[EZO_MAX_CAL_POINTS];
+};
+
+static const struct EzoDescriptor kEzoPh = {
+	"pH", "ph",
+	EZO_CMD("R", 800), EZO_CMD("i", 300), EZO_CMD("cal,clear", 1000), EZO_CMD("Sleep", 0),
+	"RT,", { 13.5, 14.3, 0.995 },
+	1, { "pH" }, { "pH" },
+	3, {
+		{ "Midpoint", "7.00 ph", EZO_CMD("cal,mid,7.00", 300) },
+		{ "Lowpoint", "4.00 ph", EZO_CMD("cal,low,4.00", 300) },
+		{ "Highpoint", "10.00 ph", EZO_CMD("cal,high,10.00", 300) },
+	},
+};
+
+static const struct EzoDescriptor kEzoEc = {
+	"EC", "conductivity",
+	EZO_CMD("R", 800), EZO_CMD("i", 300), EZO_CMD("cal,clear", 1000), EZO_CMD("Sleep", 0),
+	"RT,", { 13.0, 40.0, 0.4 },
+	4, { "EC", "TDS", "S", "SG" }, { "uS/cm", "ppm", "PSU", "" },
+	3, {
+		{ "Dry", NULL, EZO_CMD("cal,dry", 800) },
+		{ "Lowpoint", "12900", EZO_CMD("cal,low,12900", 800) },
+		{ "Highpoint", "50000", EZO_CMD("cal,high,50000", 800) },
+	},
+};
+
+static const struct EzoDescriptor kEzoDo = {
+	"D.O.", "dissolved oxygen",
+	EZO_CMD("R", 600), EZO_CMD("i", 300), EZO_CMD("cal,clear", 300), EZO_CMD("Sleep", 0),
+	"RT,", { 12.1, 13.5, 0.66 },
+	2, { "DO", "Sat" }, { "mg/L", "%" },
+	2, {
+		{ "Atmospheric", NULL, EZO_CMD("cal", 1300) },
+		{ "Zero", "0 dissolved oxygen solution", EZO_CMD("cal,0", 1300) },
+	},
+};
+
+static const struct EzoDescriptor kEzoOrp = {
+	"ORP", "orp",
+	EZO_CMD("R", 900), EZO_CMD("i", 300), EZO_CMD("cal,clear", 300), EZO_CMD("Sleep", 0),
+	NULL, { 13.5, 14.3, 0.995 },
+	1, { "ORP" }, { "mV" },
+	1, {
+		{ "Single point", "225 mV", EZO_CMD("cal,225", 900) },
+	},
+};
+
+static const struct EzoDescriptor kEzoRtd = {
+	"RTD", "temperature",
+	EZO_CMD("R", 600), EZO_CMD("i", 300), EZO_CMD("cal,clear", 300), EZO_CMD("Sleep", 0),
+	NULL, { 13.0, 15.0, 0.4 },
+	1, { "T" }, { "C" },
+	1, {
+		{ "Single point", "100.00 C", EZO_CMD("cal,100.00", 600) },
+	},
+};
+
+static const struct EzoDescriptor *kEzoDescriptors[] = { &kEzoPh, &kEzoEc, &kEzoDo, &kEzoOrp, &kEzoRtd };
+
+#define EZO_DESCRIPTOR_COUNT (sizeof(kEzoDescriptors) / sizeof(kEzoDescriptors[0]))
+
+
+/*
+ * Number of i2c transactions a bus is allowed per second. The request for a reading and the
+ * read of its result are one transaction each.
+ */
+#define BUS_BUDGET 20
+
+
+/*
+ * A reading that starts more than LATE_MS milli second after its deadline is counted as late.
+ */
+#define LATE_MS 50
+
+
+/*
+ * Time between two reports of the achieved sampling rate.
+ * Time is in second.
+ */
+#define RATE_REPORT_INTERVAL 600
+
+
+/*
+ * Number of i2c buses, number of atlas sensors and size of the value of one reading.
+ */
+#define BUS_COUNT 2
+#define PROBE_COUNT 8
+#define VALUE_SIZE 32
+
+
+/*
+ * Number of readings that can wait for the main thread.
+ */
+#define SAMPLE_QUEUE_SIZE 64
+
+
+/*
+ * Fusion of the three sensors of a type into one value.
+ * A reading further from the median than FUSION_K scaled median absolute deviations, and further than the
+ * tolerance of its type, is an outlier. The tolerance of ph is absolute, the one of conductivity is a ratio
+ * of the median.
+ * A sensor that disagrees is read again once. The row waits at most REREAD_TIMEOUT_MS for the new reading.
+ */
+#define FUSION_K 3.0
+#define MAD_SCALE 1.4826
+#define PH_TOLERANCE 0.1
+#define C_TOLERANCE_RATIO 0.02
+#define REREAD_TIMEOUT_MS 2000
+
+
+/*
+ * Recent history of the readings kept in memory for every sensor.
+ * HISTORY_DEPTH is the number of readings kept. The 1 minute rollups are kept for a day and the
+ * 10 minute rollups for a week.
+ * QUERY_REPLY_SIZE is the largest reply to a query and QUERY_MAX_POINTS the largest downsampling.
+ */
+#define HISTORY_DEPTH 4096
+#define ROLLUP_SHORT_SECONDS 60
+#define ROLLUP_SHORT_DEPTH 1440
+#define ROLLUP_LONG_SECONDS 600
+#define ROLLUP_LONG_DEPTH 1008
+#define QUERY_REPLY_SIZE (128 * 1024)
+#define QUERY_MAX_POINTS 1024
+
+
+/*
+ * Replay of recorded logs.
+ * REPLAY_MAX_FILES is the number of logs that can be replayed together.
+ * REPLAY_REPORT_INTERVAL is the time between two reports of the replay throughput, in second.
+ */
+#define REPLAY_MAX_FILES 8
+#define REPLAY_REPORT_INTERVAL 10
+
+
+/*
+ * Real-time mode of the bus workers.
+ * RT_PRIORITY is the default SCHED_FIFO priority of the bus workers.
+ * RT_STACK_SIZE is the stack of a bus worker. It is touched when the worker starts so it never page faults.
+ */
+#define RT_PRIORITY 80
+#define RT_STACK_SIZE (256 * 1024)
+
+
+/*
+ * Upper bounds of the buckets of the scheduling latency histogram.
+ * Time is in micro second. The last bucket holds everything above.
+ */
+#define LATENCY_BUCKETS 7
+static const uint64_t kLatencyBounds[LATENCY_BUCKETS - 1] = { 50, 100, 250, 500, 1000, 5000 };
+
+
+/*
+ * Soak test, run with -S days. The footprint of the daemon is measured every SOAK_CHECK_SECONDS of collection
+ * and compared with the one at the end of the warm up, the first check once the rings of the history of every sensor
+ * are full. A soak runs for at least the warm up and SOAK_MIN_CHECKS checks after it.
+ * The soak fails if the resident memory grows by more than SOAK_MAX_RSS_KB, the heap in use by more than
+ * SOAK_MAX_HEAP_KB, the allocations not freed by more than SOAK_MAX_ALLOCATIONS, the open files at all, if a reading
+ * is dropped or if the readings of a sensor over a check differ from its period by more than SOAK_MAX_DRIFT percent.
+ * Only in a build with -DSIMULATED_BUS.
+ */
+#define SOAK_CHECK_SECONDS (6 * 3600)
+#define SOAK_WARMUP_SECONDS (ROLLUP_LONG_SECONDS * ROLLUP_LONG_DEPTH)
+#define SOAK_MIN_CHECKS 4
+#define SOAK_MIN_DAYS ((SOAK_WARMUP_SECONDS + SOAK_MIN_CHECKS * SOAK_CHECK_SECONDS) / 86400.0)
+#define SOAK_MAX_RSS_KB 256
+#define SOAK_MAX_HEAP_KB 64
+#define SOAK_MAX_ALLOCATIONS 16
+#define SOAK_MAX_DRIFT 1.0
+
+static double kSoakDays;
+
+
+/*
+ * Real-time mode, turned on with -r. Off by default.
+ * kRealTimeCpus is the core each bus worker is pinned to with -c, -1 to let it run on any core.
+ * kRealTimePriority is the SCHED_FIFO priority of the bus workers, set with -p.
+ */
+static int kRealTime;
+static int kRealTimeCpus[BUS_COUNT] = { -1, -1 };
+static int kRealTimePriority = RT_PRIORITY;
+
+
+/*
+ * Power saving mode, turned on with -s. Off by default.
+ */
+static int kPowerSave;
+
+
+/*
+ * Headless mode, set by -d. The collection runs without the menu and is started and stopped on the control endpoint.
+ */
+static int kHeadless;
+
+
+/*
+ * Controller ID to identify the origin of the data stream.
+ */
+#define CONTROLLER_ID "C001"
+
+
+/*
+ * Endpoints of the data stream and of the side channel used by a subscriber to ask for a resend.
+ */
+#define STREAM_ENDPOINT "tcp://*:5556"
+#define RESEND_ENDPOINT "tcp://*:5557"
+
+
+/*
+ * Endpoint of the local queries on the recent history of the readings. Only open to this machine.
+ */
+#define QUERY_ENDPOINT "tcp://127.0.0.1:5558"
+
+
+/*
+ * Endpoint of the control requests : start and stop the collection or a sensor, change the period of a sensor,
+ * calibrate it or move it to another address. Only open to this machine.
+ */
+#define CONTROL_ENDPOINT "tcp://127.0.0.1:5559"
+
+
+/*
+ * Number of records kept per stream so that a subscriber can ask for a resend.
+ * High water mark of the publisher socket. A record dropped from the live stream when
+ * the high water mark is reached can still be recovered from the resend history.
+ */
+#define RESEND_DEPTH 256
+#define STREAM_HWM 64
+
+
+/*
+ * Size of the header and the body of one record. The body fits the json payload of a row of the longest readings.
+ */
+#define RECORD_HEADER_SIZE 64
+#define RECORD_BODY_SIZE 320
+
+
+/*
+ * A record kept in the resend history of a stream.
+ * seq is the sequence number of the record, 0 if the slot is empty.
+ * header is "controller,stream,epoch,seq" and is sent as the first frame so a subscriber can filter on it.
+ * body is the payload of the row, body_length bytes long. It is not a string with the binary payload.
+ */
+struct StreamRecord {
+	uint64_t seq;
+	char header[RECORD_HEADER_SIZE];
+	char body[RECORD_BODY_SIZE];
+	int body_length;
+};
+
+
+/*
+ * A sequence numbered stream of records.
+ * controller is the id of the controller the stream belongs to.
+ * name identifies the stream, "ph" or "c".
+ * epoch is the time at which the stream was started. It changes on every start so that a subscriber
+ * knows the sequence numbers have been restarted.
+ * next_seq is the sequence number given to the next record. The first record is 1.
+ * dropped is the number of records the publisher socket refused.
+ * history is a ring buffer of the last RESEND_DEPTH records.
+ */
+struct Stream {
+	const char *controller;
+	const char *name;
+	uint32_t epoch;
+	uint64_t next_seq;
+	unsigned long dropped;
+	struct StreamRecord history[RESEND_DEPTH];
+};
+
+
+/*
+ * Native log of the published records, turned on with -l. Every line is "time,header,row"
+ * where time is the wall clock time in milli second and row holds the three readings, also when the
+ * fusion is published. The log can be replayed with -R.
+ */
+static FILE *kLogFile;
+
+
+/*
+ * An atlas sensor and its sampling configuration.
+ * name identifies the sensor. type is 'p' for ph, 'c' for conductivity or 't' for temperature and ezo describes
+ * its commands. Only the ph and conductivity sensors fill the rows of the streams.
+ * bus is the index of the i2c bus in kBuses, addr is the i2c address and fd the file handler.
+ * counter is the column of the sensor in the stream row, 1 to 3.
+ * period_ms is the time between two readings and phase_ms the offset of the first reading.
+ * priority decides which reading goes first when two are due at the same time. Higher goes first.
+ * converting is set between the request for a reading and the read of its result.
+ * rereading is set if that reading was asked by the fusion, reread_requested while the main thread waits for it.
+ * deadline is the time the next reading is due.
+ * missing is set at the start if the sensor did not answer or is of another type than its column, device and firmware
+ * are what it answered to "i".
+ * compensated is the reading command with the last temperature of the bus, compensation that temperature and
+ * compensation_at when it was read. converting_compensation is the temperature sent with the reading in progress.
+ * asleep is set while the sensor sleeps and wake_pending while its wake event is in the heap. power_ms is the time
+ * spent in every power state, power_state the current one and power_since when it started.
+ * paused is set by the control endpoint to leave the sensor out of the schedule, period_requested to change its period.
+ * control is the last control command of the sensor, control_arg its argument and control_status its result.
+ * control_requested is set while the command waits for the bus worker, controlling while the worker waits for the sensor.
+ * The rest are the statistics used to report the achieved rate.
+ */
+struct Probe {
+	const char *name;
+	char type;
+	const struct EzoDescriptor *ezo;
+	int bus;
+	int addr;
+	int counter;
+	int period_ms;
+	int phase_ms;
+	int priority;
+	int fd;
+	int converting;
+	int rereading;
+	int reread_requested;
+	uint64_t collect_at;
+	uint64_t deadline;
+	int missing;
+	char device[8];
+	char firmware[8];
+	char compensated[16];
+	int compensated_length;
+	float compensation;
+	uint64_t compensation_at;
+	float converting_compensation;
+	int asleep;
+	int wake_pending;
+	int paused;
+	int period_requested;
+	int control;
+	int control_arg;
+	int control_status;
+	int control_requested;
+	int controlling;
+	int power_state;
+	uint64_t power_since;
+	uint64_t power_ms[POWER_STATES];
+	unsigned long samples;
+	unsigned long rereads;
+	unsigned long failed;
+	unsigned long late;
+	unsigned long skipped;
+	uint64_t max_late_ms;
+};
+
+static struct Probe kProbes[PROBE_COUNT] = {
+	{ "ph1", 'p', &kEzoPh, 0, ADDR_PH_1, 1, PERIOD_PH, 0, 1 },
+	{ "ph2", 'p', &kEzoPh, 0, ADDR_PH_2, 2, PERIOD_PH, 0, 1 },
+	{ "ph3", 'p', &kEzoPh, 0, ADDR_PH_3, 3, PERIOD_PH, 0, 1 },
+	{ "c1", 'c', &kEzoEc, 1, ADDR_C_1, 1, PERIOD_C, 0, 1 },
+	{ "c2", 'c', &kEzoEc, 1, ADDR_C_2, 2, PERIOD_C, 0, 1 },
+	{ "c3", 'c', &kEzoEc, 1, ADDR_C_3, 3, PERIOD_C, 0, 1 },
+	{ "t1", 't', &kEzoRtd, 0, ADDR_T_0, 1, PERIOD_PH, 0, 2 },
+	{ "t2", 't', &kEzoRtd, 1, ADDR_T_1, 2, PERIOD_C, 0, 2 },
+};
+
+
+/*
+ * Kind of scheduler events. A reading is split in two events so that the bus is free for the
+ * other sensors during the conversion.
+ * EVENT_START writes the "R" command. EVENT_COLLECT reads the result once the sensor has taken the reading.
+ * EVENT_REREAD writes the "R" command out of the schedule of the sensor, for the fusion.
+ * EVENT_WAKE wakes a sleeping sensor up before its next reading, in power saving mode.
+ * EVENT_CONTROL writes a control command to the sensor, then reads its answer.
+ */
+#define EVENT_COLLECT 0
+#define EVENT_REREAD 1
+#define EVENT_START 2
+#define EVENT_WAKE 3
+#define EVENT_CONTROL 4
+
+
+/*
+ * Control commands run by the bus worker between two readings of the sensor.
+ * CONTROL_CALIBRATE writes the calibration command control_arg of the sensor, -1 for clear.
+ * CONTROL_ADDRESS moves the sensor to the address control_arg and checks what it is, or removes it if control_arg is 0.
+ * The status of the command is CONTROL_BUSY until the worker has read the answer of the sensor.
+ */
+#define CONTROL_CALIBRATE 1
+#define CONTROL_ADDRESS 2
+
+#define CONTROL_NONE 0
+#define CONTROL_BUSY 1
+#define CONTROL_OK 2
+#define CONTROL_FAILED 3
+
+
+/*
+ * An event of the scheduler.
+ * when is the time the event is due, probe the index of the sensor in kProbes.
+ */
+struct Event {
+	uint64_t when;
+	int kind;
+	int priority;
+	int probe;
+};
+
+
+/*
+ * An i2c bus and its scheduler. Every bus has its own worker thread.
+ * heap is a min-heap of the pending events, ordered by the time they are due.
+ * Every sensor has at most one start, one reread, one collect, one wake and one control event pending.
+ * tokens is the number of transactions the bus can still do. It is refilled at budget per second.
+ * wakeups and the latency fields measure how late the worker wakes up for a due event.
+ */
+struct Bus {
+	const char *device;
+	int budget;
+	struct Event heap[5 * PROBE_COUNT];
+	int heap_size;
+	double tokens;
+	uint64_t refill_ms;
+	unsigned long transactions;
+	unsigned long wakeups;
+	uint64_t latency_sum_us;
+	uint64_t latency_max_us;
+	unsigned long latency_histogram[LATENCY_BUCKETS];
+	pthread_t thread;
+};
+
+static struct Bus kBuses[BUS_COUNT] = {
+	{ "/dev/i2c-0", BUS_BUDGET },
+	{ "/dev/i2c-1", BUS_BUDGET },
+};
+
+
+/*
+ * A reading passed from a bus worker or the replay to the main thread.
+ * controller is the index of the controller in kControllers, 0 for the local readings.
+ * status is the first byte of the response of the atlas sensor. 1 is a good reading,
+ * 254 means the sensor is still processing.
+ * reread is set for a reading asked by the fusion.
+ * compensation is the temperature the sensor used for the reading or NAN if there was none.
+ */
+struct Sample {
+	int controller;
+	int probe;
+	int reread;
+	float compensation;
+	time_t time;
+	unsigned char status;
+	char value[VALUE_SIZE];
+};
+
+
+/*
+ * Queue of the readings waiting for the main thread.
+ */
+static struct Sample kSampleQueue[SAMPLE_QUEUE_SIZE];
+static int kSampleHead;
+static int kSampleCount;
+static unsigned long kSamplesDropped;
+static pthread_mutex_t kSampleLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t kSampleNotFull = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t kSampleNotEmpty = PTHREAD_COND_INITIALIZER;
+
+
+/*
+ * Set while the data collection is running. The bus workers stop when it is cleared.
+ */
+static volatile int kCollecting;
+
+
+/*
+ * Set by the control endpoint to stop the collection in progress or to start a new one in headless mode.
+ * kExiting is set by SIGINT or SIGTERM in headless mode.
+ */
+static volatile int kStopRequested;
+static volatile int kStartRequested;
+static volatile int kExiting;
 
 
 /*
- * Define global string pointer to contain the string to be send from the server.
+ * A row of a stream being filled with the readings of the three sensors of one type.
+ * present is a bit mask of the columns that have a value.
+ * awaiting is a bit mask of the columns read again because they disagreed, held_at the time the row started
+ * to wait for them and reread a bit mask of the columns already read again for this row.
+ * compensation is the temperature each reading was taken with, NAN if none.
  */
-static char* kCloudDataPh;
-static char* kCloudDataCond;
+struct Row {
+	struct Stream *stream;
+	char type;
+	time_t time;
+	int present;
+	int awaiting;
+	int reread;
+	uint64_t held_at;
+	char values[3][VALUE_SIZE];
+	float compensation[3];
+};
+
+
+/*
+ * The result of the fusion of a row.
+ * value is the mean of the readings that agree and used a bit mask of their columns.
+ * outliers is a bit mask of the columns that disagree.
+ * confidence goes from 0 to 1. It is the share of the sensors that agree, lowered by how far apart they are
+ * compared to the threshold for an outlier.
+ */
+struct Fusion {
+	double value;
+	double confidence;
+	int used;
+	int outliers;
+};
+
+
+/*
+ * Fusion of the rows, on by default. With -a the three readings are published instead.
+ */
+static int kFusion = 1;
+
+
+/*
+ * Payload of the records, set with -f.
+ * PAYLOAD_CSV is the row as text. PAYLOAD_JSON and PAYLOAD_BINARY are the payload the bridge sends to the cloud as it is.
+ * The binary payload is little endian :
+ * version (1 byte, PAYLOAD_VERSION), type ('p' or 'c'), form (0 for the three readings, 1 for the fusion),
+ * columns (bit mask of the readings or of the sensors that agree), time (4 bytes, seconds since the epoch),
+ * temperature (4 byte float, NAN if none), length of the controller id (1 byte) and the id,
+ * then the three readings or the fused value and its confidence (4 byte floats, NAN for an empty reading).
+ */
+#define PAYLOAD_CSV 0
+#define PAYLOAD_JSON 1
+#define PAYLOAD_BINARY 2
+#define PAYLOAD_VERSION 1
+
+static int kPayload = PAYLOAD_CSV;
+
+
+/*
+ * A payload being written in a buffer of a given size. length is -1 once the payload did not fit.
+ */
+struct PayloadWriter {
+	char *buffer;
+	int size;
+	int length;
+};
+
+
+
+/*
+ * A controller with its two streams and the rows being filled for them.
+ * The acquisition publishes as the local controller. The replay can publish the same readings as several
+ * virtual controllers to load the subscribers like a fleet of sites.
+ */
+struct Controller {
+	char id[16];
+	struct Stream ph;
+	struct Stream cond;
+	struct Row row_ph;
+	struct Row row_cond;
+};
+
+static struct Controller kLocalController;
+static struct Controller *kControllers = &kLocalController;
+static int kControllerCount = 1;
+
+
+/*
+ * A reading kept in the history. time is in second since the epoch.
+ */
+struct HistoryPoint {
+	uint32_t time;
+	float value;
+};
+
+
+/*
+ * The readings of a sensor over a fixed interval starting at start.
+ */
+struct Rollup {
+	uint32_t start;
+	uint32_t count;
+	float min;
+	float max;
+	double sum;
+};
+
+
+/*
+ * A ring buffer of rollups of seconds long each. next is the slot written next.
+ */
+struct RollupRing {
+	int seconds;
+	int depth;
+	int count;
+	int next;
+	struct Rollup *slots;
+};
+
+
+/*
+ * The recent history of a sensor : a ring buffer of the last readings and the rings of 1 minute
+ * and 10 minute rollups, updated as the readings arrive.
+ */
+struct ProbeHistory {
+	int count;
+	int next;
+	struct HistoryPoint points[HISTORY_DEPTH];
+	struct Rollup short_slots[ROLLUP_SHORT_DEPTH];
+	struct Rollup long_slots[ROLLUP_LONG_DEPTH];
+	struct RollupRing rollups[2];
+};
+
+static struct ProbeHistory kHistory[PROBE_COUNT];
+
+
+/*
+ * A request/reply socket answered by the main thread while it waits for the readings.
+ */
+struct Endpoint {
+	const char *address;
+	void (*handler)(void *socket);
+	void *socket;
+};
+
+
+/*
+ * The reply to a query being built.
+ */
+static char kReply[QUERY_REPLY_SIZE];
+static int kReplySize;
+
+
+/*
+ * A log being replayed.
+ * type is 'p' or 'c' for a log of the bcm2835 program, which holds one sensor per file, or 0 for a native log.
+ * pending is the number of readings in samples waiting to be replayed at time_ms.
+ */
+struct ReplaySource {
+	FILE *fp;
+	char type;
+	int pending;
+	uint64_t time_ms;
+	struct Sample samples[3];
+};
+
+
+/*
+ * Replay mode, turned on with -R.
+ * kReplaySpeed is the speed of the replay with -x. 1 is real time, 0 is as fast as possible.
+ * kReplayControllers is the number of virtual controllers set with -n.
+ * kReplayRecords is the number of records read from the logs.
+ */
+static struct ReplaySource kReplaySources[REPLAY_MAX_FILES];
+static int kReplaySourceCount;
+static double kReplaySpeed = 1;
+static int kReplayControllers = 1;
+static volatile unsigned long kReplayRecords;
+static volatile int kReplayDone;
+
+
+/*
+ * Set the I2C Channel 0.
+ * Pin 27 - SDA (Data).
+ * Pin 28 - SCL (Clock).
+ * Sets up the ph sensor on Channel 0.
+ * Returns the file handler.
+ */
+static int SetI2cChannel0(int Addr_ph) {
+	return wiringPiI2CSetupInterface("/dev/i2c-0", Addr_ph);
+}
+
+
+/*
+ * Set the I2C Channel 1.
+ * Pin 3 - SDA (Data).
+ * Pin 5 - SCL (Clock).
+ * Sets up the conductivity sensor on Channel 1.
+ * Returns the file handler.
+ */
+static int SetI2cChannel1(int Addr_c) {
+	return wiringPiI2CSetupInterface("/dev/i2c-1", Addr_c);
+}
+
+
+/*
+ * Write a command to the atlas sensor. Does not wait for the sensor to process it.
+ */
+static void WriteCommand(int channel, const struct EzoCommand *command) {
+	write(channel, command->text, command->length);
+}
+
+
+/*
+ * Read the data provided by the atlas sensor.
+ */
+static void ReadData(int channel, char *buffer) {
+	read(channel, buffer, 32);
+}
+
+
+/*
+ * Returns the time of the monotonic clock in micro second.
+ */
+static uint64_t NowUs(void) {
+#ifdef SIMULATED_BUS
+	return SimulatedNowUs();
+#else
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+#endif
+}
+
+
+/*
+ * Returns the time of the monotonic clock in milli second.
+ */
+static uint64_t NowMs(void) {
+	return NowUs() / 1000;
+}
+
+
+/*
+ * Sleep until the monotonic clock reaches when, in milli second.
+ */
+static void SleepUntilMs(uint64_t when) {
+#ifdef SIMULATED_BUS
+	SimulatedSleepUntilUs(when * 1000);
+#else
+	struct timespec until;
+	until.tv_sec = when / 1000;
+	until.tv_nsec = (when % 1000) * 1000000;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) == EINTR) {
+	}
+#endif
+}
+
+
+/*
+ * Returns the wall clock time in milli second.
+ */
+static uint64_t WallMs(void) {
+#ifdef SIMULATED_BUS
+	return SimulatedWallUs() / 1000;
+#else
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+#endif
+}
+
+
+/*
+ * Set up the controller with the given id and its two streams.
+ */
+static void InitController(struct Controller *controller, const char *id) {
+	snprintf(controller->id, sizeof(controller->id), "%s", id);
+	controller->ph.controller = controller->id;
+	controller->ph.name = kFusion ? "ph" : "ph_raw";
+	controller->cond.controller = controller->id;
+	controller->cond.name = kFusion ? "c" : "c_raw";
+	controller->row_ph.stream = &controller->ph;
+	controller->row_ph.type = 'p';
+	controller->row_cond.stream = &controller->cond;
+	controller->row_cond.type = 'c';
+}
+
+
+/*
+ * Start a new epoch of the stream. The sequence numbers start again from 1 and the resend history is emptied.
+ */
+static void StartStream(struct Stream *stream, uint32_t epoch) {
+	stream->epoch = epoch;
+	stream->next_seq = 1;
+	stream->dropped = 0;
+	memset(stream->history, 0, sizeof(stream->history));
+}
+
+
+/*
+ * Returns the record with the sequence number seq from the resend history or NULL if it is no longer kept.
+ */
+static struct StreamRecord *FindRecord(struct Stream *stream, uint64_t seq) {
+	struct StreamRecord *record = &stream->history[seq % RESEND_DEPTH];
+	if (seq == 0 || record->seq != seq) {
+		return NULL;
+	}
+	return record;
+}
+
+
+/*
+ * Send the header and the body of a record as a two frame message.
+ * The send never blocks. Returns 0 on success or -1 if the socket refused the record.
+ */
+static int SendRecord(void *socket, struct StreamRecord *record, int flags) {
+	if (zmq_send(socket, record->header, strlen(record->header), ZMQ_SNDMORE | flags) < 0) {
+		return -1;
+	}
+	if (zmq_send(socket, record->body, record->body_length, flags) < 0) {
+		return -1;
+	}
+	return 0;
+}
+
+
+/*
+ * Give the next sequence number to the body of length bytes, keep it in the resend history and publish it.
+ * A record the publisher refuses is counted as dropped. The subscriber sees the gap in the sequence
+ * numbers and asks for it on the side channel.
+ * Returns the record as kept in the history.
+ */
+static struct StreamRecord *PublishRecord(void *publisher, struct Stream *stream, const char *body, int length) {
+	uint64_t seq = stream->next_seq++;
+	struct StreamRecord *record = &stream->history[seq % RESEND_DEPTH];
+
+	record->seq = seq;
+	snprintf(record->header, RECORD_HEADER_SIZE, "%s,%s,%u,%llu", stream->controller, stream->name, stream->epoch,
+			(unsigned long long)seq);
+	record->body_length = length < RECORD_BODY_SIZE ? length : RECORD_BODY_SIZE;
+	memcpy(record->body, body, record->body_length);
+
+	if (SendRecord(publisher, record, ZMQ_DONTWAIT) < 0) {
+		stream->dropped++;
+	}
+	return record;
+}
+
+
+/*
+ * Returns the stream with the given name of the given controller or NULL if there is none.
+ */
+static struct Stream *FindStream(const char *id, const char *name) {
+	int i;
+
+	for (i = 0; i < kControllerCount; i++) {
+		struct Controller *controller = &kControllers[i];
+		if (strcmp(id, controller->id) != 0) {
+			continue;
+		}
+		if (strcmp(name, controller->ph.name) == 0) {
+			return &controller->ph;
+		}
+		if (strcmp(name, controller->cond.name) == 0) {
+			return &controller->cond;
+		}
+	}
+	return NULL;
+}
+
+
+/*
+ * Reply to one request on the resend side channel.
+ * Request : "RESEND controller stream epoch first last".
+ * Reply   : "OK first last" followed by the header and body frames of every record kept in that range.
+ *           "STALE epoch last" if the request is for another epoch of the stream.
+ *           "ERROR reason" if the request can not be understood.
+ * The range is cut to the records still kept in the history, so any record before first is lost.
+ */
+static void HandleResendRequest(void *socket) {
+	char request[128];
+	char id[16];
+	char name[16];
+	char reply[64];
+	unsigned int epoch;
+	unsigned long long first;
+	unsigned long long last;
+
+	int size = zmq_recv(socket, request, sizeof(request) - 1, 0);
+	if (size < 0) {
+		return;
+	}
+	request[size < sizeof(request) - 1 ? size : sizeof(request) - 1] = '\0';
+
+	if (sscanf(request, "RESEND %15s %15s %u %llu %llu", id, name, &epoch, &first, &last) != 5 || first > last) {
+		zmq_send(socket, "ERROR bad request", 17, 0);
+		return;
+	}
+
+	struct Stream *stream = FindStream(id, name);
+	if (stream == NULL) {
+		zmq_send(socket, "ERROR unknown stream", 20, 0);
+		return;
+	}
+
+	uint64_t newest = stream->next_seq - 1;
+	if (epoch != stream->epoch) {
+		snprintf(reply, sizeof(reply), "STALE %u %llu", stream->epoch, (unsigned long long)newest);
+		zmq_send(socket, reply, strlen(reply), 0);
+		return;
+	}
+
+	//Only the last RESEND_DEPTH records are kept.
+	uint64_t oldest = newest >= RESEND_DEPTH ? newest - RESEND_DEPTH + 1 : 1;
+	if (first < oldest) {
+		first = oldest;
+	}
+	if (last > newest) {
+		last = newest;
+	}
+
+	snprintf(reply, sizeof(reply), "OK %llu %llu", first, last);
+	if (first > last) {
+		zmq_send(socket, reply, strlen(reply), 0);
+		return;
+	}
+	zmq_send(socket, reply, strlen(reply), ZMQ_SNDMORE);
+
+	uint64_t seq;
+	for (seq = first; seq <= last; seq++) {
+		SendRecord(socket, FindRecord(stream, seq), seq < last ? ZMQ_SNDMORE : 0);
+	}
+}
+
+
+/*
+ * Returns 1 if the event a is due before the event b.
+ * At the same time a collect goes before a start and a higher priority goes first.
+ */
+static int EventBefore(struct Event *a, struct Event *b) {
+	if (a->when != b->when) {
+		return a->when < b->when;
+	}
+	if (a->kind != b->kind) {
+		return a->kind < b->kind;
+	}
+	return a->priority > b->priority;
+}
+
+
+/*
+ * Add an event to the heap of the bus.
+ */
+static void PushEvent(struct Bus *bus, uint64_t when, int kind, int index) {
+	int child = bus->heap_size++;
+	struct Event event = { when, kind, kProbes[index].priority, index };
+
+	while (child > 0) {
+		int parent = (child - 1) / 2;
+		if (!EventBefore(&event, &bus->heap[parent])) {
+			break;
+		}
+		bus->heap[child] = bus->heap[parent];
+		child = parent;
+	}
+	bus->heap[child] = event;
+}
+
+
+/*
+ * Remove the first event from the heap of the bus.
+ */
+static void PopEvent(struct Bus *bus) {
+	struct Event last = bus->heap[--bus->heap_size];
+	int parent = 0;
+
+	for (;;) {
+		int child = 2 * parent + 1;
+		if (child >= bus->heap_size) {
+			break;
+		}
+		if (child + 1 < bus->heap_size && EventBefore(&bus->heap[child + 1], &bus->heap[child])) {
+			child++;
+		}
+		if (!EventBefore(&bus->heap[child], &last)) {
+			break;
+		}
+		bus->heap[parent] = bus->heap[child];
+		parent = child;
+	}
+	bus->heap[parent] = last;
+}
+
+
+/*
+ * Take one transaction from the budget of the bus.
+ * Returns 1 if the transaction can be done now or 0 if the budget is used up.
+ */
+static int TakeToken(struct Bus *bus, uint64_t now) {
+	bus->tokens += (double)(now - bus->refill_ms) * bus->budget / 1000;
+	if (bus->tokens > bus->budget) {
+		bus->tokens = bus->budget;
+	}
+	bus->refill_ms = now;
+
+	if (bus->tokens < 1) {
+		return 0;
+	}
+	bus->tokens -= 1;
+	bus->transactions++;
+	return 1;
+}
+
+
+/*
+ * Put a reading in the queue of the main thread. The reading is dropped if the queue is full.
+ */
+static void PushSample(struct Sample *sample) {
+	pthread_mutex_lock(&kSampleLock);
+	if (kSampleCount == SAMPLE_QUEUE_SIZE) {
+		kSamplesDropped++;
+	}
+	else {
+		kSampleQueue[(kSampleHead + kSampleCount) % SAMPLE_QUEUE_SIZE] = *sample;
+		kSampleCount++;
+	}
+	pthread_mutex_unlock(&kSampleLock);
+}
+
+
+/*
+ * Put a reading in the queue of the main thread. Waits while the queue is full, so that the replay
+ * runs at the speed of the main thread instead of dropping readings.
+ */
+static void PushSampleWait(struct Sample *sample) {
+	pthread_mutex_lock(&kSampleLock);
+	while (kSampleCount == SAMPLE_QUEUE_SIZE) {
+		pthread_cond_wait(&kSampleNotFull, &kSampleLock);
+	}
+	kSampleQueue[(kSampleHead + kSampleCount) % SAMPLE_QUEUE_SIZE] = *sample;
+	kSampleCount++;
+	pthread_cond_signal(&kSampleNotEmpty);
+	pthread_mutex_unlock(&kSampleLock);
+}
+
+
+/*
+ * Wait at most wait_ms milli second for a reading put in the queue by PushSampleWait().
+ * Returns at once if the queue is not empty.
+ */
+static void WaitSample(int wait_ms) {
+	struct timespec until;
+
+	clock_gettime(CLOCK_REALTIME, &until);
+	until.tv_nsec += wait_ms * 1000000L;
+	if (until.tv_nsec >= 1000000000L) {
+		until.tv_sec++;
+		until.tv_nsec -= 1000000000L;
+	}
+	pthread_mutex_lock(&kSampleLock);
+	if (kSampleCount == 0) {
+		pthread_cond_timedwait(&kSampleNotEmpty, &kSampleLock, &until);
+	}
+	pthread_mutex_unlock(&kSampleLock);
+}
+
+
+/*
+ * Take the oldest reading from the queue.
+ * Returns 1 if there was one or 0 if the queue is empty.
+ */
+static int PopSample(struct Sample *sample) {
+	int found = 0;
+
+	pthread_mutex_lock(&kSampleLock);
+	if (kSampleCount > 0) {
+		*sample = kSampleQueue[kSampleHead];
+		kSampleHead = (kSampleHead + 1) % SAMPLE_QUEUE_SIZE;
+		kSampleCount--;
+		found = 1;
+		pthread_cond_signal(&kSampleNotFull);
+	}
+	pthread_mutex_unlock(&kSampleLock);
+	return found;
+}
+
+
+/*
+ * Add the time since the last change to the current power state of the sensor and move it to the given state.
+ */
+static void SetPowerState(struct Probe *probe, int state, uint64_t now) {
+	probe->power_ms[probe->power_state] += now - probe->power_since;
+	probe->power_state = state;
+	probe->power_since = now;
+}
+
+
+/*
+ * Wake the sensor up with a command it answers without side effect. It can take a reading WAKE_MS later.
+ */
+static void WakeProbe(struct Probe *probe, uint64_t now) {
+	WriteCommand(probe->fd, &probe->ezo->info);
+	probe->asleep = 0;
+	SetPowerState(probe, POWER_IDLE, now);
+}
+
+
+/*
+ * In power saving mode, put the sensor to sleep once its reading is read if the next one is far enough
+ * and schedule its wake up WAKE_MS before the next one.
+ */
+static void SleepProbe(struct Bus *bus, int index, uint64_t now) {
+	struct Probe *probe = &kProbes[index];
+
+	if (!kPowerSave || probe->reread_requested || probe->control_requested ||
+			probe->deadline < now + MIN_SLEEP_MS + WAKE_MS) {
+		return;
+	}
+	WriteCommand(probe->fd, &probe->ezo->sleep);
+	probe->asleep = 1;
+	SetPowerState(probe, POWER_ASLEEP, now);
+	if (!probe->wake_pending) {
+		probe->wake_pending = 1;
+		PushEvent(bus, probe->deadline - WAKE_MS, EVENT_WAKE, index);
+	}
+}
+
+
+/*
+ * Request a reading from the sensor. The temperature of the bus is sent with it if the sensor uses it and
+ * the temperature is recent.
+ */
+static void RequestReading(struct Probe *probe, uint64_t now) {
+	if (probe->compensated_length > 0 && now - probe->compensation_at <= COMPENSATION_MAX_AGE_MS) {
+		write(probe->fd, probe->compensated, probe->compensated_length);
+		probe->converting_compensation = probe->compensation;
+	}
+	else {
+		WriteCommand(probe->fd, &probe->ezo->read);
+		probe->converting_compensation = NAN;
+	}
+	SetPowerState(probe, POWER_READING, now);
+}
+
+
+/*
+ * Prepare the reading command with the temperature for the sensors of the bus that use it.
+ * Called by the worker of the bus, which is the only one to use the commands, as soon as the temperature is read.
+ * The reading that is converting keeps the temperature it was started with.
+ */
+static void SetCompensation(int bus, const char *temperature, uint64_t now) {
+	int i;
+
+	for (i = 0; i < PROBE_COUNT; i++) {
+		struct Probe *probe = &kProbes[i];
+		if (probe->bus != bus || probe->ezo->compensate == NULL) {
+			continue;
+		}
+		int length = snprintf(probe->compensated, sizeof(probe->compensated), "%s%s", probe->ezo->compensate,
+				temperature);
+		probe->compensated_length = length < (int)sizeof(probe->compensated) ? length : 0;
+		probe->compensation = strtof(temperature, NULL);
+		probe->compensation_at = now;
+	}
+}
+
+
+/*
+ * Request a reading from the sensor and schedule the read of its result and its next reading.
+ * The next deadline is kept on the grid of the period. Deadlines that have already passed are skipped
+ * so that a sensor that fell behind does not burst to catch up.
+ */
+static void StartReading(struct Bus *bus, int index, uint64_t now) {
+	struct Probe *probe = &kProbes[index];
+
+	//The sensor is still busy with the previous reading. Try again once its result is read.
+	if (probe->converting) {
+		PushEvent(bus, probe->collect_at, EVENT_START, index);
+		return;
+	}
+
+	//The sensor is paused, missing or busy with a control command. It keeps its place on the grid of its period.
+	if (probe->controlling || probe->missing || __atomic_load_n(&probe->paused, __ATOMIC_ACQUIRE)) {
+		do {
+			probe->deadline += probe->period_ms;
+		} while (probe->deadline <= now);
+		PushEvent(bus, probe->deadline, EVENT_START, index);
+		return;
+	}
+
+	//The sensor is still asleep. Wake it up and try again once it is awake. The reading is late.
+	if (probe->asleep) {
+		WakeProbe(probe, now);
+		PushEvent(bus, now + WAKE_MS, EVENT_START, index);
+		return;
+	}
+
+	uint64_t late = now - probe->deadline;
+	if (late > LATE_MS) {
+		probe->late++;
+	}
+	if (late > probe->max_late_ms) {
+		probe->max_late_ms = late;
+	}
+
+	RequestReading(probe, now);
+	probe->converting = 1;
+	probe->collect_at = now + probe->ezo->read.delay_ms;
+	PushEvent(bus, probe->collect_at, EVENT_COLLECT, index);
+
+	probe->deadline += probe->period_ms;
+	if (probe->deadline <= now) {
+		uint64_t missed = (now - probe->deadline) / probe->period_ms + 1;
+		probe->skipped += missed;
+		probe->deadline += missed * probe->period_ms;
+	}
+	PushEvent(bus, probe->deadline, EVENT_START, index);
+}
+
+
+/*
+ * Request a reading from the sensor out of its schedule, for the fusion. The schedule of the sensor is not changed.
+ */
+static void RereadProbe(struct Bus *bus, int index, uint64_t now) {
+	struct Probe *probe = &kProbes[index];
+
+	//The sensor is busy with a reading. Read it again once that one is read.
+	if (probe->converting) {
+		PushEvent(bus, probe->collect_at, EVENT_REREAD, index);
+		return;
+	}
+
+	//The sensor is busy with a control command. The row does not wait for it longer than REREAD_TIMEOUT_MS.
+	if (probe->controlling) {
+		return;
+	}
+
+	//The sensor went to sleep before the fusion asked for it. Read it again once it is awake.
+	if (probe->asleep) {
+		WakeProbe(probe, now);
+		PushEvent(bus, now + WAKE_MS, EVENT_REREAD, index);
+		return;
+	}
+
+	RequestReading(probe, now);
+	probe->converting = 1;
+	probe->rereading = 1;
+	probe->collect_at = now + probe->ezo->read.delay_ms;
+	PushEvent(bus, probe->collect_at, EVENT_COLLECT, index);
+}
+
+
+/*
+ * Keep the first field of a reading, the value that is published, in value.
+ * Returns 1 if the reading has at least one and at most field_count fields of the descriptor, 0 otherwise.
+ */
+static int ParseReading(const struct EzoDescriptor *ezo, const char *reading, char *value) {
+	int count = 1;
+	const char *field;
+
+	for (field = strchr(reading, ','); field != NULL; field = strchr(field + 1, ',')) {
+		count++;
+	}
+	snprintf(value, VALUE_SIZE, "%.*s", (int)strcspn(reading, ","), reading);
+	return value[0] != '\0' && count <= ezo->field_count;
+}
+
+
+/*
+ * Read the result of a reading from the sensor and pass it to the main thread.
+ */
+static void CollectReading(struct Bus *bus, int index, uint64_t now) {
+	struct Probe *probe = &kProbes[index];
+	struct Sample sample;
+	char buffer[33] = { 0 };
+
+	ReadData(probe->fd, buffer);
+	probe->converting = 0;
+	SetPowerState(probe, POWER_IDLE, now);
+
+	sample.controller = 0;
+	sample.probe = index;
+	sample.reread = probe->rereading;
+	sample.compensation = probe->converting_compensation;
+	sample.time = time(NULL);
+	sample.status = (unsigned char)buffer[0];
+	//We require only the first field of the reading. A reading that does not match the fields of the sensor failed.
+	if (!ParseReading(probe->ezo, buffer + 1, sample.value) && sample.status == 1) {
+		sample.status = 2;
+	}
+
+	//The ph and conductivity sensors of the bus read with this temperature from now on.
+	if (probe->type == 't' && sample.status == 1) {
+		double temperature = strtod(sample.value, NULL);
+		if (temperature >= RTD_MIN_C && temperature <= RTD_MAX_C) {
+			SetCompensation(probe->bus, sample.value, now);
+		}
+	}
+
+	if (probe->rereading) {
+		probe->rereads++;
+		probe->rereading = 0;
+	}
+	else if (sample.status == 1) {
+		probe->samples++;
+	}
+	else {
+		probe->failed++;
+	}
+	PushSample(&sample);
+	SleepProbe(bus, index, now);
+}
+
+
+/*
+ * Returns the description of the atlas sensor that answers device to the "i" command or NULL if it is not known.
+ */
+static const struct EzoDescriptor *FindEzoDescriptor(const char *device) {
+	size_t i;
+
+	for (i = 0; i < EZO_DESCRIPTOR_COUNT; i++) {
+		if (strcasecmp(kEzoDescriptors[i]->device, device) == 0) {
+			return kEzoDescriptors[i];
+		}
+	}
+	return NULL;
+}
+
+
+/*
+ * Keep the device and firmware of the sensor from its answer to the "i" command, "?I,device,firmware".
+ * Returns 1 if the answer is one, 0 otherwise.
+ */
+static int ParseInfo(struct Probe *probe, char *buffer) {
+	if (buffer[0] != 1 || strncmp(buffer + 1, "?I,", 3) != 0) {
+		return 0;
+	}
+	char *firmware = strchr(buffer + 4, ',');
+	if (firmware != NULL) {
+		*firmware++ = '\0';
+		snprintf(probe->firmware, sizeof(probe->firmware), "%s", firmware);
+	}
+	snprintf(probe->device, sizeof(probe->device), "%s", buffer + 4);
+	return 1;
+}
+
+
+/*
+ * Run the control command of the sensor. The command waits for the reading in progress to be read and wakes the
+ * sensor up if it sleeps. Its answer is read once the sensor has processed it.
+ * Only this sensor leaves the schedule while the command runs, the other sensors of the bus keep their readings.
+ */
+static void RunControl(struct Bus *bus, int index, uint64_t now) {
+	struct Probe *probe = &kProbes[index];
+	const struct EzoCommand *command;
+	char buffer[33] = { 0 };
+	int status;
+
+	//The sensor has processed the command. Read its answer.
+	if (probe->controlling) {
+		ReadData(probe->fd, buffer);
+		probe->controlling = 0;
+		//The sensor at the new address must be of the type of the column, or it is left out.
+		if (probe->control == CONTROL_ADDRESS) {
+			probe->missing = !ParseInfo(probe, buffer) || FindEzoDescriptor(probe->device) != probe->ezo;
+			status = probe->missing ? CONTROL_FAILED : CONTROL_OK;
+		}
+		else {
+			status = buffer[0] == 1 ? CONTROL_OK : CONTROL_FAILED;
+		}
+		__atomic_store_n(&probe->control_status, status, __ATOMIC_RELEASE);
+		return;
+	}
+
+	//The sensor is busy with a reading. Run the command once that one is read.
+	if (probe->converting) {
+		PushEvent(bus, probe->collect_at, EVENT_CONTROL, index);
+		return;
+	}
+
+	if (probe->control == CONTROL_ADDRESS) {
+		if (probe->control_arg == 0) {
+			probe->missing = 1;
+			__atomic_store_n(&probe->control_status, CONTROL_OK, __ATOMIC_RELEASE);
+			return;
+		}
+		int fd = wiringPiI2CSetupInterface(bus->device, probe->control_arg);
+		if (fd < 0) {
+			__atomic_store_n(&probe->control_status, CONTROL_FAILED, __ATOMIC_RELEASE);
+			return;
+		}
+		close(probe->fd);
+		probe->fd = fd;
+		probe->addr = probe->control_arg;
+		probe->asleep = 0;
+		probe->device[0] = '\0';
+		probe->firmware[0] = '\0';
+		SetPowerState(probe, POWER_IDLE, now);
+		command = &probe->ezo->info;
+	}
+	else {
+		//The sensor went to sleep after its reading. Run the command once it is awake.
+		if (probe->asleep) {
+			WakeProbe(probe, now);
+			PushEvent(bus, now + WAKE_MS, EVENT_CONTROL, index);
+			return;
+		}
+		command = probe->control_arg < 0 ? &probe->ezo->clear : &probe->ezo->cal[probe->control_arg].command;
+	}
+
+	WriteCommand(probe->fd, command);
+	probe->controlling = 1;
+	PushEvent(bus, now + command->delay_ms, EVENT_CONTROL, index);
+}
+
+
+/*
+ * Take the requests of the main thread for the sensors of the bus. Every request only changes its own sensor.
+ * Readings asked again by the fusion go first. A new period is used from the next reading of the sensor on.
+ */
+static void ApplyRequests(struct Bus *bus, uint64_t now) {
+	int i;
+
+	for (i = 0; i < PROBE_COUNT; i++) {
+		struct Probe *probe = &kProbes[i];
+		if (&kBuses[probe->bus] != bus) {
+			continue;
+		}
+		if (__atomic_exchange_n(&probe->reread_requested, 0, __ATOMIC_ACQ_REL)) {
+			PushEvent(bus, now, EVENT_REREAD, i);
+		}
+		int period = __atomic_exchange_n(&probe->period_requested, 0, __ATOMIC_ACQ_REL);
+		if (period > 0) {
+			probe->period_ms = period;
+		}
+		if (__atomic_exchange_n(&probe->control_requested, 0, __ATOMIC_ACQ_REL)) {
+			PushEvent(bus, now, EVENT_CONTROL, i);
+		}
+	}
+}
+
+
+/*
+ * Record how late the worker of the bus woke up for an event.
+ */
+static void RecordLatency(struct Bus *bus, uint64_t latency_us) {
+	int bucket = 0;
+
+	while (bucket < LATENCY_BUCKETS - 1 && latency_us > kLatencyBounds[bucket]) {
+		bucket++;
+	}
+	bus->latency_histogram[bucket]++;
+	bus->latency_sum_us += latency_us;
+	if (latency_us > bus->latency_max_us) {
+		bus->latency_max_us = latency_us;
+	}
+	bus->wakeups++;
+}
+
+
+/*
+ * Touch the stack of the calling thread so that its pages are mapped before the first deadline.
+ */
+static void PrefaultStack(void) {
+	volatile char stack[RT_STACK_SIZE / 2];
+	memset((char *)stack, 0, sizeof(stack));
+}
+
+
+/*
+ * Returns the time the next batch of events of the bus is due : the time of the last event due within
+ * COALESCE_MS of the first one. The events of the batch are run one after the other at that time.
+ */
+static uint64_t BatchDue(struct Bus *bus) {
+	uint64_t first = bus->heap[0].when;
+	uint64_t last = first;
+	int i;
+
+	for (i = 1; i < bus->heap_size; i++) {
+		if (bus->heap[i].when > last && bus->heap[i].when <= first + COALESCE_MS) {
+			last = bus->heap[i].when;
+		}
+	}
+	return last;
+}
+
+
+/*
+ * The worker thread of a bus. Runs the events of the bus as they become due, within the transaction
+ * budget of the bus. The requests for readings of different sensors are interleaved so that the bus
+ * is used during the conversion of the other sensors.
+ */
+static void *BusWorker(void *arguments) {
+	struct Bus *bus = arguments;
+
+	if (kRealTime) {
+		PrefaultStack();
+	}
+
+	while (kCollecting) {
+		uint64_t now = NowMs();
+
+		ApplyRequests(bus, now);
+
+		int poll_ms = kPowerSave ? POWER_POLL_MS : 100;
+		if (bus->heap_size == 0) {
+			delay(poll_ms);
+			continue;
+		}
+
+		//Sleep until the next event is due, but wake up often enough to see the end of the collection.
+		uint64_t when = kPowerSave ? BatchDue(bus) : bus->heap[0].when;
+		if (when > now) {
+			if (when - now > (uint64_t)poll_ms) {
+				delay(poll_ms);
+			}
+			else {
+				SleepUntilMs(when);
+				RecordLatency(bus, NowUs() - when * 1000);
+			}
+			continue;
+		}
+
+		//The budget of the bus is used up. Wait for the next transaction.
+		if (!TakeToken(bus, now)) {
+			delay(1000 / bus->budget);
+			continue;
+		}
+
+		struct Event event = bus->heap[0];
+		PopEvent(bus);
+		if (event.kind == EVENT_START) {
+			StartReading(bus, event.probe, now);
+		}
+		else if (event.kind == EVENT_REREAD) {
+			RereadProbe(bus, event.probe, now);
+		}
+		else if (event.kind == EVENT_CONTROL) {
+			RunControl(bus, event.probe, now);
+		}
+		else if (event.kind == EVENT_WAKE) {
+			kProbes[event.probe].wake_pending = 0;
+			if (kProbes[event.probe].asleep) {
+				WakeProbe(&kProbes[event.probe], now);
+			}
+		}
+		else {
+			CollectReading(bus, event.probe, now);
+		}
+	}
+	return NULL;
+}
+
+
+/*
+ * Start the worker thread of the bus.
+ * In real-time mode the worker runs with SCHED_FIFO, on its own locked stack, pinned to its core if one is given.
+ * If the real-time attributes are refused (not running as root) the worker runs at the default priority.
+ */
+static void StartBusWorker(struct Bus *bus, int index) {
+	pthread_attr_t attr;
+	struct sched_param param;
+
+	if (kRealTime) {
+		pthread_attr_init(&attr);
+		pthread_attr_setstacksize(&attr, RT_STACK_SIZE);
+		pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+		pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+		param.sched_priority = kRealTimePriority;
+		pthread_attr_setschedparam(&attr, &param);
+		if (kRealTimeCpus[index] >= 0) {
+			cpu_set_t cpus;
+			CPU_ZERO(&cpus);
+			CPU_SET(kRealTimeCpus[index], &cpus);
+			pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+		}
+		int rc = pthread_create(&bus->thread, &attr, &BusWorker, (void *)bus);
+		pthread_attr_destroy(&attr);
+		if (rc == 0) {
+			return;
+		}
+		printf("error : real-time worker for %s refused (%s). Running at default priority. \n", bus->device,
+				strerror(rc));
+	}
+	pthread_create(&bus->thread, NULL, &BusWorker, (void *)bus);
+}
+
+
+/*
+ * Schedule the first reading of every sensor and start the worker thread of every bus.
+ * The missing and paused sensors are scheduled too, so that they are read once they are back.
+ */
+static void StartScheduler(uint64_t start) {
+	int i;
+
+	kCollecting = 1;
+	for (i = 0; i < BUS_COUNT; i++) {
+		kBuses[i].heap_size = 0;
+		kBuses[i].tokens = kBuses[i].budget;
+		kBuses[i].refill_ms = start;
+		kBuses[i].transactions = 0;
+		kBuses[i].wakeups = 0;
+		kBuses[i].latency_sum_us = 0;
+		kBuses[i].latency_max_us = 0;
+		memset(kBuses[i].latency_histogram, 0, sizeof(kBuses[i].latency_histogram));
+	}
+	for (i = 0; i < PROBE_COUNT; i++) {
+		struct Probe *probe = &kProbes[i];
+		probe->converting = 0;
+		probe->rereading = 0;
+		probe->reread_requested = 0;
+		probe->compensated_length = 0;
+		probe->asleep = 0;
+		probe->wake_pending = 0;
+		probe->controlling = 0;
+		probe->control_requested = 0;
+		probe->power_state = POWER_IDLE;
+		probe->power_since = start;
+		memset(probe->power_ms, 0, sizeof(probe->power_ms));
+		probe->deadline = start + probe->phase_ms;
+		probe->samples = 0;
+		probe->rereads = 0;
+		probe->failed = 0;
+		probe->late = 0;
+		probe->skipped = 0;
+		probe->max_late_ms = 0;
+		PushEvent(&kBuses[probe->bus], probe->deadline, EVENT_START, i);
+	}
+	for (i = 0; i < BUS_COUNT; i++) {
+		StartBusWorker(&kBuses[i], i);
+	}
+}
+
+
+/*
+ * Ask all the sensors of a bus what they are with the "i" command. The sensors answer at the same time,
+ * so the bus waits once, for the slowest of them, instead of once per sensor.
+ * The answer is "?I,device,firmware". A sensor that does not answer, or answers with another type than the one of
+ * its column, is marked missing.
+ */
+static void *DiscoverBus(void *arguments) {
+	struct Bus *bus = (struct Bus*)arguments;
+	int pending[PROBE_COUNT];
+	int retry;
+	int i;
+
+	//Only the sensors of this bus, the worker of the other bus may have found its own already.
+	for (i = 0; i < PROBE_COUNT; i++) {
+		struct Probe *probe = &kProbes[i];
+		pending[i] = &kBuses[probe->bus] == bus;
+		if (pending[i]) {
+			probe->missing = 0;
+			probe->device[0] = '\0';
+			probe->firmware[0] = '\0';
+		}
+	}
+
+	for (retry = 0; retry < INFO_RETRIES; retry++) {
+		int asked = 0;
+		int wait_ms = 0;
+		for (i = 0; i < PROBE_COUNT; i++) {
+			if (pending[i]) {
+				const struct EzoCommand *info = &kProbes[i].ezo->info;
+				if (write(kProbes[i].fd, info->text, info->length) != info->length) {
+					kProbes[i].missing = 1;
+					pending[i] = 0;
+				}
+				else {
+					asked++;
+					wait_ms = info->delay_ms > wait_ms ? info->delay_ms : wait_ms;
+				}
+			}
+		}
+		if (asked == 0) {
+			break;
+		}
+		delay(wait_ms);
+
+		for (i = 0; i < PROBE_COUNT; i++) {
+			char buffer[33] = { 0 };
+			if (!pending[i]) {
+				continue;
+			}
+			if (read(kProbes[i].fd, buffer, 32) < 1) {
+				kProbes[i].missing = 1;
+				pending[i] = 0;
+				continue;
+			}
+
+			//Still busy, or asleep from a previous run and woken up by the command. Ask again with the others.
+			if ((unsigned char)buffer[0] == 254 || (unsigned char)buffer[0] == 255) {
+				continue;
+			}
+			pending[i] = 0;
+			//The sensor must be of the type of the column, or it is left out.
+			kProbes[i].missing = !ParseInfo(&kProbes[i], buffer) ||
+					FindEzoDescriptor(kProbes[i].device) != kProbes[i].ezo;
+		}
+	}
+
+	//Never stopped being busy.
+	for (i = 0; i < PROBE_COUNT; i++) {
+		if (pending[i]) {
+			kProbes[i].missing = 1;
+		}
+	}
+	return NULL;
+}
+
+
+/*
+ * Find the sensors present on all the buses at the same time and display the table of the devices.
+ * A missing sensor, or one of another type than its column, is not read during the data collection.
+ * Returns the number of sensors present.
+ */
+static int DiscoverProbes(void) {
+	uint64_t start = NowMs();
+	int present = 0;
+	int i;
+
+	for (i = 0; i < BUS_COUNT; i++) {
+		if (pthread_create(&kBuses[i].thread, NULL, DiscoverBus, &kBuses[i]) != 0) {
+			DiscoverBus(&kBuses[i]);
+			kBuses[i].thread = pthread_self();
+		}
+	}
+	for (i = 0; i < BUS_COUNT; i++) {
+		if (!pthread_equal(kBuses[i].thread, pthread_self())) {
+			pthread_join(kBuses[i].thread, NULL);
+		}
+	}
+
+	printf("\nSensor  Bus         Address  Device  Firmware\n");
+	for (i = 0; i < PROBE_COUNT; i++) {
+		struct Probe *probe = &kProbes[i];
+		const char *expected = probe->ezo->device;
+		if (probe->missing && probe->device[0] == '\0') {
+			printf("%-6s  %-10s  0x%02x     missing\n", probe->name, kBuses[probe->bus].device, probe->addr);
+			continue;
+		}
+		printf("%-6s  %-10s  0x%02x     %-6s  %s", probe->name, kBuses[probe->bus].device, probe->addr,
+				probe->device, probe->firmware);
+		const struct EzoDescriptor *found = FindEzoDescriptor(probe->device);
+		if (found == NULL) {
+			printf("  (unknown device, expected %s, left out)", expected);
+		}
+		else if (found != probe->ezo) {
+			printf("  (%s sensor, expected %s, left out)", found->label, expected);
+		}
+		else {
+			present++;
+		}
+		printf("\n");
+	}
+	printf("%d of %d sensors found in %llu ms.\n", present, PROBE_COUNT, (unsigned long long)(NowMs() - start));
+	return present;
+}
+
+
+/*
+ * Stop the worker threads of the buses and wait for them to finish.
+ * The sensors left asleep are woken up so that the calibration and the dry run can use them.
+ * A control command that did not run or whose answer was not read yet has failed.
+ */
+static void StopScheduler(void) {
+	uint64_t now;
+	int asleep = 0;
+	int i;
+
+	kCollecting = 0;
+	for (i = 0; i < BUS_COUNT; i++) {
+		pthread_join(kBuses[i].thread, NULL);
+	}
+
+	now = NowMs();
+	for (i = 0; i < PROBE_COUNT; i++) {
+		SetPowerState(&kProbes[i], kProbes[i].power_state, now);
+		if (kProbes[i].controlling || kProbes[i].control_requested) {
+			kProbes[i].controlling = 0;
+			kProbes[i].control_requested = 0;
+			__atomic_store_n(&kProbes[i].control_status, CONTROL_FAILED, __ATOMIC_RELEASE);
+		}
+		if (kProbes[i].asleep) {
+			WakeProbe(&kProbes[i], now);
+			asleep++;
+		}
+	}
+	if (asleep > 0) {
+		delay(WAKE_MS);
+	}
+}
+
+
+/*
+ * Returns the index in kProbes of the sensor of the given type and column or -1 if there is none.
+ */
+static int FindProbe(char type, int counter) {
+	int i;
+
+	for (i = 0; i < PROBE_COUNT; i++) {
+		if (kProbes[i].type == type && kProbes[i].counter == counter) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+
+/*
+ * Returns the bit mask of the columns of the given type that have a sensor. Missing and paused sensors leave their
+ * column empty.
+ */
+static int RowColumns(char type) {
+	int columns = 0;
+	int i;
+
+	for (i = 0; i < PROBE_COUNT; i++) {
+		if (kProbes[i].type == type && !kProbes[i].missing && !kProbes[i].paused) {
+			columns |= 1 << (kProbes[i].counter - 1);
+		}
+	}
+	return columns;
+}
+
+
+/*
+ * Sort two values in place.
+ */
+static void SortPair(double *a, double *b) {
+	if (*a > *b) {
+		double swap = *a;
+		*a = *b;
+		*b = swap;
+	}
+}
+
+
+/*
+ * Returns the median of up to three values. Constant time.
+ */
+static double Median3(double *values, int count) {
+	double a = values[0];
+	double b = count > 1 ? values[1] : a;
+	double c = count > 2 ? values[2] : b;
+
+	if (count == 2) {
+		return (a + b) / 2;
+	}
+	SortPair(&a, &b);
+	SortPair(&b, &c);
+	SortPair(&a, &b);
+	return b;
+}
+
+
+/*
+ * Fuse the readings of the row into one value with the median and the median absolute deviation (MAD).
+ * Readings further than FUSION_K scaled MADs, and further than the tolerance of the type, from the median
+ * are outliers. The value is the mean of the other readings.
+ */
+static void FuseRow(struct Row *row, struct Fusion *fusion) {
+	double values[3];
+	double deviations[3];
+	int columns[3];
+	int count = 0;
+	int i;
+
+	memset(fusion, 0, sizeof(*fusion));
+	for (i = 0; i < 3; i++) {
+		char *end;
+		double value = strtod(row->values[i], &end);
+		if (end != row->values[i]) {
+			values[count] = value;
+			columns[count] = i;
+			count++;
+		}
+	}
+	if (count == 0) {
+		return;
+	}
+
+	double median = Median3(values, count);
+	for (i = 0; i < count; i++) {
+		deviations[i] = fabs(values[i] - median);
+	}
+	double tolerance = row->type == 'c' ? C_TOLERANCE_RATIO * fabs(median) : PH_TOLERANCE;
+	double spread = FUSION_K * MAD_SCALE * Median3(deviations, count);
+	double threshold = spread > tolerance ? spread : tolerance;
+
+	double sum = 0;
+	double largest = 0;
+	int used = 0;
+	for (i = 0; i < count; i++) {
+		if (deviations[i] > threshold) {
+			fusion->outliers |= 1 << columns[i];
+			continue;
+		}
+		fusion->used |= 1 << columns[i];
+		sum += values[i];
+		used++;
+	}
+	fusion->value = sum / used;
+	for (i = 0; i < count; i++) {
+		if ((fusion->used & (1 << columns[i])) && fabs(values[i] - fusion->value) > largest) {
+			largest = fabs(values[i] - fusion->value);
+		}
+	}
+	fusion->confidence = (used / 3.0) * (1 - largest / threshold);
+	if (fusion->confidence < 0) {
+		fusion->confidence = 0;
+	}
+}
+
+
+/*
+ * Write the mean of the temperatures the readings of the row were taken with, or nothing if there is none.
+ */
+static void FormatCompensation(struct Row *row, char *buffer, size_t size) {
+	float sum = 0;
+	int count = 0;
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		if ((row->present & (1 << i)) && !isnan(row->compensation[i])) {
+			sum += row->compensation[i];
+			count++;
+		}
+	}
+	if (count == 0) {
+		buffer[0] = '\0';
+		return;
+	}
+	snprintf(buffer, size, "%.1f", sum / count);
+}
+
+
+/*
+ * Add text to the payload. Nothing is allocated.
+ */
+static void AppendPayload(struct PayloadWriter *writer, const char *format, ...) {
+	va_list args;
+
+	if (writer->length < 0) {
+		return;
+	}
+	va_start(args, format);
+	int size = vsnprintf(writer->buffer + writer->length, writer->size - writer->length, format, args);
+	va_end(args);
+	writer->length = size < 0 || size >= writer->size - writer->length ? -1 : writer->length + size;
+}
+
+
+/*
+ * Add bytes to the payload.
+ */
+static void AppendPayloadBytes(struct PayloadWriter *writer, const void *bytes, int count) {
+	if (writer->length < 0 || count > writer->size - writer->length) {
+		writer->length = -1;
+		return;
+	}
+	memcpy(writer->buffer + writer->length, bytes, count);
+	writer->length += count;
+}
+
+
+/*
+ * Add a 4 byte little endian integer to the payload.
+ */
+static void AppendPayloadU32(struct PayloadWriter *writer, uint32_t value) {
+	unsigned char bytes[4] = { value & 0xff, (value >> 8) & 0xff, (value >> 16) & 0xff, value >> 24 };
+	AppendPayloadBytes(writer, bytes, 4);
+}
+
+
+/*
+ * Add a 4 byte little endian float to the payload.
+ */
+static void AppendPayloadFloat(struct PayloadWriter *writer, float value) {
+	uint32_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+	AppendPayloadU32(writer, bits);
+}
+
+
+/*
+ * Write the json payload of the row, with the same fields the bridge used to build from the csv row.
+ * The fields are named after the type : "ph_data" or "c_data1" for example.
+ */
+static void EncodeJson(struct PayloadWriter *writer, struct Row *row, struct Fusion *fusion, const char *date,
+		const char *clock, const char *compensation) {
+	const char *prefix = row->type == 'c' ? "c" : "ph";
+
+	AppendPayload(writer, "{\"controller_id\":\"%s\",\"date\":\"%s\",\"time\":\"%s\",\"timestamp\":%ld",
+			row->stream->controller, date, clock, (long)row->time);
+	if (fusion != NULL && fusion->used) {
+		AppendPayload(writer, ",\"%s_data\":\"%.6g\",\"%s_confidence\":\"%.2f\",\"%s_sensors\":\"%s%s%s\"", prefix,
+				fusion->value, prefix, fusion->confidence, prefix, fusion->used & 1 ? "1" : "",
+				fusion->used & 2 ? "2" : "", fusion->used & 4 ? "3" : "");
+	}
+	else if (fusion != NULL) {
+		AppendPayload(writer, ",\"%s_data\":\"\",\"%s_confidence\":\"0.00\",\"%s_sensors\":\"\"", prefix, prefix, prefix);
+	}
+	else {
+		AppendPayload(writer, ",\"%s_data1\":\"%s\",\"%s_data2\":\"%s\",\"%s_data3\":\"%s\"", prefix, row->values[0],
+				prefix, row->values[1], prefix, row->values[2]);
+	}
+	AppendPayload(writer, ",\"%s_temperature\":\"%s\"}", prefix, compensation);
+}
+
+
+/*
+ * Write the binary payload of the row. See PAYLOAD_BINARY.
+ */
+static void EncodeBinary(struct PayloadWriter *writer, struct Row *row, struct Fusion *fusion,
+		const char *compensation) {
+	unsigned char head[4] = { PAYLOAD_VERSION, row->type, fusion != NULL, fusion != NULL ? fusion->used : row->present };
+	unsigned char id_length = strlen(row->stream->controller);
+	int i;
+
+	AppendPayloadBytes(writer, head, sizeof(head));
+	AppendPayloadU32(writer, (uint32_t)row->time);
+	AppendPayloadFloat(writer, compensation[0] != '\0' ? strtof(compensation, NULL) : NAN);
+	AppendPayloadBytes(writer, &id_length, 1);
+	AppendPayloadBytes(writer, row->stream->controller, id_length);
+	if (fusion != NULL) {
+		AppendPayloadFloat(writer, fusion->used ? fusion->value : NAN);
+		AppendPayloadFloat(writer, fusion->confidence);
+		return;
+	}
+	for (i = 0; i < 3; i++) {
+		char *end;
+		float value = strtof(row->values[i], &end);
+		AppendPayloadFloat(writer, end != row->values[i] ? value : NAN);
+	}
+}
+
+
+/*
+ * Write the row to the native log, with the header of the record published for it.
+ */
+static void LogRow(struct StreamRecord *record, const char *row_text) {
+	fprintf(kLogFile, "%llu,%s,%s\n", (unsigned long long)WallMs(), record->header, row_text);
+}
+
+
+/*
+ * Publish the row and empty it. The columns without a good reading are left empty.
+ * With the fusion the body is "date,time,value,confidence,sensors,temperature" where sensors lists the columns
+ * that agree, else it is "date,time,value1,value2,value3,temperature". temperature is the one the sensors
+ * compensated the readings with, empty if they did not.
+ */
+static void FlushRow(void *publisher, struct Row *row) {
+	char body[RECORD_BODY_SIZE];
+	char row_text[RECORD_BODY_SIZE];
+	char date[16];
+	char clock[8];
+	char compensation[16];
+	struct Fusion fusion;
+	struct PayloadWriter writer = { body, sizeof(body), 0 };
+
+	//Time Format : YYYY-MM-DD, HH:MM.
+	struct tm tm_info;
+	localtime_r(&row->time, &tm_info);
+	strftime(date, sizeof(date), "%Y-%m-%d", &tm_info);
+	strftime(clock, sizeof(clock), "%H:%M", &tm_info);
+	FormatCompensation(row, compensation, sizeof(compensation));
+	snprintf(row_text, sizeof(row_text), "%s,%s,%s,%s,%s,%s", date, clock, row->values[0], row->values[1],
+			row->values[2], compensation);
+
+	if (kFusion) {
+		FuseRow(row, &fusion);
+	}
+	if (kPayload == PAYLOAD_JSON) {
+		EncodeJson(&writer, row, kFusion ? &fusion : NULL, date, clock, compensation);
+	}
+	else if (kPayload == PAYLOAD_BINARY) {
+		EncodeBinary(&writer, row, kFusion ? &fusion : NULL, compensation);
+	}
+	else if (kFusion && fusion.used) {
+		AppendPayload(&writer, "%s,%s,%.6g,%.2f,%s%s%s,%s", date, clock, fusion.value, fusion.confidence,
+				fusion.used & 1 ? "1" : "", fusion.used & 2 ? "2" : "", fusion.used & 4 ? "3" : "", compensation);
+	}
+	else if (kFusion) {
+		AppendPayload(&writer, "%s,%s,,0.00,,%s", date, clock, compensation);
+	}
+	else {
+		AppendPayload(&writer, "%s", row_text);
+	}
+
+	//Values are at most VALUE_SIZE long so a row always fits. Publish what fits rather than nothing.
+	if (writer.length < 0) {
+		writer.length = strnlen(body, sizeof(body));
+	}
+	struct StreamRecord *record = PublishRecord(publisher, row->stream, body, writer.length);
+	if (kLogFile != NULL) {
+		LogRow(record, row_text);
+	}
+
+	row->present = 0;
+	row->awaiting = 0;
+	row->reread = 0;
+	memset(row->values, 0, sizeof(row->values));
+}
+
+
+/*
+ * The row has a reading for every sensor. Publish it, unless a sensor disagrees with the others and has
+ * not been read again yet. That sensor, and only that one, is read again right away and the row waits for it.
+ * Sensors are only read again during the data collection, not during a replay.
+ */
+static void CompleteRow(void *publisher, struct Row *row) {
+	struct Fusion fusion;
+	int column;
+
+	if (kFusion && kReplaySourceCount == 0) {
+		FuseRow(row, &fusion);
+		int outliers = fusion.outliers & ~row->reread;
+		if (outliers) {
+			for (column = 0; column < 3; column++) {
+				int index = FindProbe(row->type, column + 1);
+				if ((outliers & (1 << column)) && index >= 0) {
+					__atomic_store_n(&kProbes[index].reread_requested, 1, __ATOMIC_RELEASE);
+				}
+			}
+			row->awaiting = outliers;
+			row->reread |= outliers;
+			row->held_at = NowMs();
+			return;
+		}
+	}
+	FlushRow(publisher, row);
+}
+
+
+/*
+ * Put the reading in the row of its type. The row is completed once all three sensors have a reading,
+ * or published earlier if a sensor has a new reading before the others caught up.
+ * A reading asked again by the fusion replaces the one in the row that waits for it.
+ */
+static void AddToRow(void *publisher, struct Sample *sample) {
+	struct Probe *probe = &kProbes[sample->probe];
+	struct Controller *controller = &kControllers[sample->controller];
+	struct Row *row = probe->type == 'c' ? &controller->row_cond : &controller->row_ph;
+	int column = probe->counter - 1;
+
+	//The temperature is sent to the other sensors, it has no stream of its own.
+	if (probe->type == 't') {
+		return;
+	}
+
+	if (sample->reread) {
+		//The row has already been published without it.
+		if (!(row->awaiting & (1 << column))) {
+			return;
+		}
+		if (sample->status == 1) {
+			snprintf(row->values[column], VALUE_SIZE, "%s", sample->value);
+			row->compensation[column] = sample->compensation;
+		}
+		row->awaiting &= ~(1 << column);
+		if (row->awaiting == 0) {
+			CompleteRow(publisher, row);
+		}
+		return;
+	}
+
+	if (row->present & (1 << column)) {
+		FlushRow(publisher, row);
+	}
+	if (row->present == 0) {
+		row->time = sample->time;
+	}
+	if (sample->status == 1) {
+		snprintf(row->values[column], VALUE_SIZE, "%s", sample->value);
+	}
+	row->compensation[column] = sample->compensation;
+	row->present |= 1 << column;
+
+	if (row->present == RowColumns(row->type)) {
+		CompleteRow(publisher, row);
+	}
+}
+
+
+/*
+ * Publish the rows that waited longer than REREAD_TIMEOUT_MS for a sensor to be read again.
+ */
+static void FlushHeldRows(void *publisher) {
+	uint64_t now = NowMs();
+	int i;
+
+	for (i = 0; i < kControllerCount; i++) {
+		struct Row *rows[] = { &kControllers[i].row_ph, &kControllers[i].row_cond };
+		int j;
+		for (j = 0; j < 2; j++) {
+			if (rows[j]->awaiting && now - rows[j]->held_at > REREAD_TIMEOUT_MS) {
+				FlushRow(publisher, rows[j]);
+			}
+		}
+	}
+}
+
+
+/*
+ * Displays the reading with its time and the sensor it comes from.
+ * The function will display "Still Processing" if the first char of the response is a 254.
+ */
+static void DisplaySample(struct Sample *sample) {
+	char time_buffer[32];
+
+	if (sample->status == 254) {
+		printf("Still Processing \n\n");
+		return;
+	}
+
+	//Time Format : YYYY-MM-DD, HH:MM.
+	strftime(time_buffer, sizeof(time_buffer), "%Y-%m-%d,%H:%M", localtime(&sample->time));
+	if (isnan(sample->compensation)) {
+		printf("%s %s : %s %s\n", time_buffer, kProbes[sample->probe].name, sample->value,
+				kProbes[sample->probe].ezo->units[0]);
+	}
+	else {
+		printf("%s %s : %s %s at %.1f C\n", time_buffer, kProbes[sample->probe].name, sample->value,
+				kProbes[sample->probe].ezo->units[0], sample->compensation);
+	}
+}
+
+
+/*
+ * Set up the rollup rings of the history of every sensor.
+ */
+static void InitHistory(void) {
+	int i;
+
+	for (i = 0; i < PROBE_COUNT; i++) {
+		struct ProbeHistory *history = &kHistory[i];
+		struct RollupRing short_ring = { ROLLUP_SHORT_SECONDS, ROLLUP_SHORT_DEPTH, 0, 0, history->short_slots };
+		struct RollupRing long_ring = { ROLLUP_LONG_SECONDS, ROLLUP_LONG_DEPTH, 0, 0, history->long_slots };
+		history->count = 0;
+		history->next = 0;
+		history->rollups[0] = short_ring;
+		history->rollups[1] = long_ring;
+	}
+}
+
+
+/*
+ * Returns the i-th oldest reading of the history.
+ */
+static struct HistoryPoint *HistoryAt(struct ProbeHistory *history, int i) {
+	return &history->points[(history->next - history->count + i + HISTORY_DEPTH) % HISTORY_DEPTH];
+}
+
+
+/*
+ * Returns the i-th oldest rollup of the ring.
+ */
+static struct Rollup *RollupAt(struct RollupRing *ring, int i) {
+	return &ring->slots[(ring->next - ring->count + i + ring->depth) % ring->depth];
+}
+
+
+/*
+ * Add a reading to the rollup it falls in. A reading older than the newest rollup is left out.
+ */
+static void AddToRollup(struct RollupRing *ring, uint32_t time, float value) {
+	uint32_t start = time - time % ring->seconds;
+	struct Rollup *rollup = ring->count > 0 ? RollupAt(ring, ring->count - 1) : NULL;
+
+	if (rollup != NULL && start < rollup->start) {
+		return;
+	}
+	if (rollup == NULL || start != rollup->start) {
+		rollup = &ring->slots[ring->next];
+		ring->next = (ring->next + 1) % ring->depth;
+		if (ring->count < ring->depth) {
+			ring->count++;
+		}
+		rollup->start = start;
+		rollup->count = 0;
+		rollup->min = value;
+		rollup->max = value;
+		rollup->sum = 0;
+	}
+	rollup->count++;
+	rollup->sum += value;
+	if (value < rollup->min) {
+		rollup->min = value;
+	}
+	if (value > rollup->max) {
+		rollup->max = value;
+	}
+}
+
+
+/*
+ * Keep a good reading of the local controller in the history of its sensor.
+ */
+static void AddToHistory(struct Sample *sample) {
+	if (sample->controller != 0 || sample->status != 1) {
+		return;
+	}
+
+	char *end;
+	float value = strtof(sample->value, &end);
+	if (end == sample->value) {
+		return;
+	}
+
+	struct ProbeHistory *history = &kHistory[sample->probe];
+	struct HistoryPoint *point = &history->points[history->next];
+	point->time = (uint32_t)sample->time;
+	point->value = value;
+	history->next = (history->next + 1) % HISTORY_DEPTH;
+	if (history->count < HISTORY_DEPTH) {
+		history->count++;
+	}
+	AddToRollup(&history->rollups[0], point->time, value);
+	AddToRollup(&history->rollups[1], point->time, value);
+}
+
+
+/*
+ * Returns the index of the oldest reading of the history at or after time.
+ */
+static int FindHistoryTime(struct ProbeHistory *history, uint32_t time) {
+	int low = 0;
+	int high = history->count;
+
+	while (low < high) {
+		int middle = (low + high) / 2;
+		if (HistoryAt(history, middle)->time < time) {
+			low = middle + 1;
+		}
+		else {
+			high = middle;
+		}
+	}
+	return low;
+}
+
+
+/*
+ * Returns the index in kProbes of the sensor with the given name or -1 if there is none.
+ */
+static int FindProbeByName(const char *name) {
+	int i;
+
+	for (i = 0; i < PROBE_COUNT; i++) {
+		if (strcmp(name, kProbes[i].name) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+
+/*
+ * Add a line to the reply. Returns 0 on success or -1 if the reply is full.
+ */
+static int AppendReply(const char *format, ...) {
+	va_list args;
+
+	va_start(args, format);
+	int size = vsnprintf(kReply + kReplySize, QUERY_REPLY_SIZE - kReplySize, format, args);
+	va_end(args);
+	if (size < 0 || size >= QUERY_REPLY_SIZE - kReplySize) {
+		kReply[kReplySize] = '\0';
+		return -1;
+	}
+	kReplySize += size;
+	return 0;
+}
+
+
+/*
+ * Put the readings first to last of the history in the reply, one "time,value" per line.
+ * Returns the number of readings in the reply.
+ */
+static int ReplyPoints(struct ProbeHistory *history, int first, int last) {
+	int i;
+
+	for (i = first; i < last; i++) {
+		struct HistoryPoint *point = HistoryAt(history, i);
+		if (AppendReply("%u,%g\n", point->time, point->value) < 0) {
+			break;
+		}
+	}
+	return i - first;
+}
+
+
+/*
+ * Put the range [t0,t1] downsampled to k points in the reply, one "time,mean,count" per line.
+ * The range is cut in k equal buckets and every bucket holds the mean of the readings in it.
+ * The readings are taken from the history if nothing before t0 has been dropped from it, else from the
+ * finest rollups for which that holds. A rollup goes in the bucket of its start.
+ * Returns the number of points in the reply.
+ */
+static int ReplyDownsampled(struct ProbeHistory *history, uint32_t t0, uint32_t t1, int k) {
+	static double sums[QUERY_MAX_POINTS];
+	static uint32_t counts[QUERY_MAX_POINTS];
+	//In double, so that the whole range 0..UINT32_MAX does not wrap to 0.
+	double width = ((double)t1 - t0 + 1) / k;
+	int points = 0;
+	int i;
+
+	memset(sums, 0, k * sizeof(sums[0]));
+	memset(counts, 0, k * sizeof(counts[0]));
+
+	if (history->count < HISTORY_DEPTH || HistoryAt(history, 0)->time <= t0) {
+		for (i = FindHistoryTime(history, t0); i < history->count; i++) {
+			struct HistoryPoint *point = HistoryAt(history, i);
+			if (point->time > t1) {
+				break;
+			}
+			int bucket = (int)((point->time - t0) / width);
+			if (bucket > k - 1) {
+				bucket = k - 1;
+			}
+			sums[bucket] += point->value;
+			counts[bucket]++;
+		}
+	}
+	else {
+		struct RollupRing *ring = &history->rollups[0];
+		if (ring->count == ring->depth && RollupAt(ring, 0)->start > t0) {
+			ring = &history->rollups[1];
+		}
+		for (i = 0; i < ring->count; i++) {
+			struct Rollup *rollup = RollupAt(ring, i);
+			if (rollup->start + ring->seconds <= t0 || rollup->start > t1) {
+				continue;
+			}
+			int bucket = rollup->start > t0 ? (int)((rollup->start - t0) / width) : 0;
+			if (bucket > k - 1) {
+				bucket = k - 1;
+			}
+			sums[bucket] += rollup->sum;
+			counts[bucket] += rollup->count;
+		}
+	}
+
+	for (i = 0; i < k; i++) {
+		if (counts[i] == 0) {
+			continue;
+		}
+		if (AppendReply("%u,%g,%u\n", t0 + (uint32_t)(i * width), sums[i] / counts[i], counts[i]) < 0) {
+			break;
+		}
+		points++;
+	}
+	return points;
+}
+
+
+/*
+ * Put the last n rollups of the ring in the reply, one "start,count,min,max,mean" per line.
+ * Returns the number of rollups in the reply.
+ */
+static int ReplyRollups(struct RollupRing *ring, unsigned int n) {
+	int i;
+	//n is compared unsigned : a count above INT_MAX would otherwise turn into a negative first rollup.
+	int first = n < (unsigned int)ring->count ? ring->count - (int)n : 0;
+
+	for (i = first; i < ring->count; i++) {
+		struct Rollup *rollup = RollupAt(ring, i);
+		if (AppendReply("%u,%u,%g,%g,%g\n", rollup->start, rollup->count, rollup->min, rollup->max,
+				rollup->sum / rollup->count) < 0) {
+			break;
+		}
+	}
+	return i - first;
+}
+
+
+/*
+ * Reply to one query on the recent history. Times are in second since the epoch.
+ * Query : "LAST sensor n"                  the last n readings.
+ *         "RANGE sensor t0 t1"             the readings between t0 and t1.
+ *         "DOWNSAMPLE sensor t0 t1 k"      the readings between t0 and t1 downsampled to k points.
+ *         "ROLLUP sensor 1|10 n"           the last n rollups of 1 or 10 minutes.
+ *         "SENSORS"                        every sensor with the number and time span of its readings.
+ * Reply : "OK count" followed by a frame with one line per point, or "ERROR reason".
+ */
+static void HandleQueryRequest(void *socket) {
+	char request[128];
+	char verb[16];
+	char name[16];
+	char status[32];
+	unsigned int a = 0;
+	unsigned int b = 0;
+	unsigned int c = 0;
+	int count = 0;
+	int i;
+
+	int size = zmq_recv(socket, request, sizeof(request) - 1, 0);
+	if (size < 0) {
+		return;
+	}
+	request[size < sizeof(request) - 1 ? size : sizeof(request) - 1] = '\0';
+
+	kReplySize = 0;
+	kReply[0] = '\0';
+	int fields = sscanf(request, "%15s %15s %u %u %u", verb, name, &a, &b, &c);
+	int index = fields >= 2 ? FindProbeByName(name) : -1;
+	struct ProbeHistory *history = index >= 0 ? &kHistory[index] : NULL;
+
+	if (fields == 1 && strcmp(verb, "SENSORS") == 0) {
+		for (i = 0; i < PROBE_COUNT; i++) {
+			history = &kHistory[i];
+			AppendReply("%s,%d,%u,%u\n", kProbes[i].name, history->count,
+					history->count ? HistoryAt(history, 0)->time : 0,
+					history->count ? HistoryAt(history, history->count - 1)->time : 0);
+		}
+		count = PROBE_COUNT;
+	}
+	else if (fields >= 2 && history == NULL) {
+		zmq_send(socket, "ERROR unknown sensor", 20, 0);
+		return;
+	}
+	else if (fields == 3 && strcmp(verb, "LAST") == 0) {
+		int first = a < (unsigned int)history->count ? history->count - (int)a : 0;
+		count = ReplyPoints(history, first, history->count);
+	}
+	else if (fields == 4 && strcmp(verb, "RANGE") == 0 && a <= b) {
+		int first = FindHistoryTime(history, a);
+		count = ReplyPoints(history, first, b == UINT32_MAX ? history->count : FindHistoryTime(history, b + 1));
+	}
+	else if (fields == 5 && strcmp(verb, "DOWNSAMPLE") == 0 && a <= b && c > 0 && c <= QUERY_MAX_POINTS) {
+		count = ReplyDownsampled(history, a, b, (int)c);
+	}
+	else if (fields == 4 && strcmp(verb, "ROLLUP") == 0 && (a == 1 || a == 10)) {
+		count = ReplyRollups(&history->rollups[a == 1 ? 0 : 1], b);
+	}
+	else {
+		zmq_send(socket, "ERROR bad request", 17, 0);
+		return;
+	}
+
+	snprintf(status, sizeof(status), "OK %d", count);
+	zmq_send(socket, status, strlen(status), ZMQ_SNDMORE);
+	zmq_send(socket, kReply, kReplySize, 0);
+}
+
+
+/*
+ * Publish every reading waiting in the queue. The readings are displayed if display is set.
+ */
+static void DrainSamples(void *publisher, int display) {
+	struct Sample sample;
+
+	while (PopSample(&sample)) {
+		if (display) {
+			DisplaySample(&sample);
+		}
+		AddToHistory(&sample);
+		AddToRow(publisher, &sample);
+	}
+}
+
+
+/*
+ * Start a new epoch of the streams of every controller. epoch is the start time in second. A collection started
+ * within the same second as the previous one gets the next epoch, so that every start has its own epoch.
+ */
+static void StartStreams(uint32_t epoch) {
+	static uint32_t last_epoch;
+	int i;
+
+	if (epoch <= last_epoch) {
+		epoch = last_epoch + 1;
+	}
+	last_epoch = epoch;
+	for (i = 0; i < kControllerCount; i++) {
+		StartStream(&kControllers[i].ph, epoch);
+		StartStream(&kControllers[i].cond, epoch);
+	}
+}
+
+
+/*
+ * Publish the rows that are not complete yet. Used at the end of a collection.
+ */
+static void FlushRows(void *publisher) {
+	int i;
+
+	for (i = 0; i < kControllerCount; i++) {
+		if (kControllers[i].row_ph.present) {
+			FlushRow(publisher, &kControllers[i].row_ph);
+		}
+		if (kControllers[i].row_cond.present) {
+			FlushRow(publisher, &kControllers[i].row_cond);
+		}
+	}
+}
+
+
+/*
+ * Display the number of records published and dropped by the publisher, over all the controllers.
+ */
+static void DisplayPublishReport(void) {
+	unsigned long long published = 0;
+	unsigned long dropped = 0;
+	int i;
+
+	for (i = 0; i < kControllerCount; i++) {
+		published += kControllers[i].ph.next_seq - 1 + kControllers[i].cond.next_seq - 1;
+		dropped += kControllers[i].ph.dropped + kControllers[i].cond.dropped;
+	}
+	printf("Records published : %llu, dropped by the publisher : %lu\n", published, dropped);
+}
+
+
+/*
+ * Describe the state of the sensor and the result of its last control command for the STATUS request.
+ */
+static void AppendProbeStatus(struct Probe *probe) {
+	static const char *statuses[] = { "none", "busy", "ok", "failed" };
+	const char *state = "sampling";
+	char control[32] = "none";
+
+	if (probe->missing) {
+		state = "missing";
+	}
+	else if (probe->paused) {
+		state = "paused";
+	}
+	else if (probe->controlling) {
+		state = "control";
+	}
+	else if (probe->asleep) {
+		state = "asleep";
+	}
+
+	int status = __atomic_load_n(&probe->control_status, __ATOMIC_ACQUIRE);
+	if (status != CONTROL_NONE && probe->control == CONTROL_CALIBRATE) {
+		snprintf(control, sizeof(control), "calibrate %s %s",
+				probe->control_arg < 0 ? "clear" : probe->ezo->cal[probe->control_arg].name, statuses[status]);
+	}
+	else if (status != CONTROL_NONE && probe->control_arg == 0) {
+		snprintf(control, sizeof(control), "address none %s", statuses[status]);
+	}
+	else if (status != CONTROL_NONE) {
+		snprintf(control, sizeof(control), "address 0x%02x %s", probe->control_arg, statuses[status]);
+	}
+	AppendReply("%s,%d,0x%02x,%d,%s,%s,%lu,%lu,%s\n", probe->name, probe->bus, probe->addr, probe->period_ms, state,
+			probe->device, probe->samples, probe->failed, control);
+}
+
+
+/*
+ * Returns 1 if another sensor present on the bus of the sensor is read at the address, or is being moved to it.
+ */
+static int AddressInUse(struct Probe *probe, int addr) {
+	int i;
+
+	for (i = 0; i < PROBE_COUNT; i++) {
+		struct Probe *other = &kProbes[i];
+		if (other == probe || other->bus != probe->bus) {
+			continue;
+		}
+		if (other->addr == addr && !other->missing) {
+			return 1;
+		}
+		if (other->control == CONTROL_ADDRESS && other->control_arg == addr &&
+				__atomic_load_n(&other->control_status, __ATOMIC_ACQUIRE) == CONTROL_BUSY) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+
+/*
+ * Pass a control command to the bus worker of the sensor. Returns -1 if the previous command of the sensor is still running.
+ */
+static int RequestControl(struct Probe *probe, int control, int arg) {
+	if (__atomic_load_n(&probe->control_status, __ATOMIC_ACQUIRE) == CONTROL_BUSY) {
+		return -1;
+	}
+	probe->control = control;
+	probe->control_arg = arg;
+	__atomic_store_n(&probe->control_status, CONTROL_BUSY, __ATOMIC_RELEASE);
+	__atomic_store_n(&probe->control_requested, 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+
+/*
+ * Answer a request on the control endpoint. The requests are :
+ * "STATUS", the state of every sensor, one "name,bus,address,period,state,device,samples,failed,control" per line.
+ * "START" and "STOP", start a collection in headless mode and stop the collection in progress or about to start.
+ * "START name" and "STOP name", put a sensor back in the schedule and leave it out.
+ * "PERIOD name ms", change the period of a sensor from its next reading on.
+ * "CALIBRATE name point", run the calibration point of a sensor, "clear" or the start of the name of the point.
+ * "ADDRESS name address", move a sensor to another address of its bus not used by another sensor, or remove it
+ * with "none".
+ * CALIBRATE and ADDRESS only run during a collection, a new period is used by the next collection if none is running.
+ * The changes to a sensor are made by the worker of its bus between its readings, the other sensors keep their schedule.
+ * The reply is "OK", or "OK count collecting|idle" followed by a frame for STATUS, or "ERROR reason".
+ * The result of CALIBRATE and ADDRESS is shown by STATUS once the sensor has answered.
+ */
+static void HandleControlRequest(void *socket) {
+	char request[128];
+	char verb[16];
+	char name[16];
+	char arg[16];
+	char status[32];
+	const char *error = NULL;
+	int i;
+
+	int size = zmq_recv(socket, request, sizeof(request) - 1, 0);
+	if (size < 0) {
+		return;
+	}
+	request[size < sizeof(request) - 1 ? size : sizeof(request) - 1] = '\0';
+
+	int fields = sscanf(request, "%15s %15s %15s", verb, name, arg);
+	int index = fields >= 2 ? FindProbeByName(name) : -1;
+	struct Probe *probe = index >= 0 ? &kProbes[index] : NULL;
+
+	if (fields == 1 && strcmp(verb, "STATUS") == 0) {
+		kReplySize = 0;
+		kReply[0] = '\0';
+		for (i = 0; i < PROBE_COUNT; i++) {
+			AppendProbeStatus(&kProbes[i]);
+		}
+		snprintf(status, sizeof(status), "OK %d %s", PROBE_COUNT, kCollecting ? "collecting" : "idle");
+		zmq_send(socket, status, strlen(status), ZMQ_SNDMORE);
+		zmq_send(socket, kReply, kReplySize, 0);
+		return;
+	}
+
+	if (fields == 1 && strcmp(verb, "START") == 0) {
+		if (kCollecting) {
+			error = "ERROR already collecting";
+		}
+		else {
+			kStartRequested = 1;
+		}
+	}
+	else if (fields == 1 && strcmp(verb, "STOP") == 0) {
+		if (kStartRequested) {
+			kStartRequested = 0;
+		}
+		else if (!kCollecting) {
+			error = "ERROR not collecting";
+		}
+		else {
+			kStopRequested = 1;
+		}
+	}
+	else if (fields >= 2 && probe == NULL) {
+		error = "ERROR unknown sensor";
+	}
+	else if (fields == 2 && (strcmp(verb, "START") == 0 || strcmp(verb, "STOP") == 0)) {
+		__atomic_store_n(&probe->paused, strcmp(verb, "STOP") == 0, __ATOMIC_RELEASE);
+	}
+	else if (fields == 3 && strcmp(verb, "PERIOD") == 0) {
+		char *end;
+		long period = strtol(arg, &end, 10);
+		if (end == arg || *end != '\0' || period < probe->ezo->read.delay_ms || period > 24 * 3600 * 1000L) {
+			error = "ERROR bad period";
+		}
+		else if (!kCollecting) {
+			//No bus worker is running. The next collection starts with the new period.
+			probe->period_ms = (int)period;
+		}
+		else {
+			__atomic_store_n(&probe->period_requested, (int)period, __ATOMIC_RELEASE);
+		}
+	}
+	else if (fields == 3 && strcmp(verb, "CALIBRATE") == 0) {
+		int point = strcasecmp(arg, "clear") == 0 ? -1 : probe->ezo->cal_count;
+		for (i = 0; point == probe->ezo->cal_count && i < probe->ezo->cal_count; i++) {
+			if (strncasecmp(probe->ezo->cal[i].name, arg, strlen(arg)) == 0) {
+				point = i;
+			}
+		}
+		if (point == probe->ezo->cal_count) {
+			error = "ERROR unknown calibration point";
+		}
+		else if (!kCollecting) {
+			error = "ERROR not collecting";
+		}
+		else if (probe->missing) {
+			error = "ERROR sensor missing";
+		}
+		else if (RequestControl(probe, CONTROL_CALIBRATE, point) < 0) {
+			error = "ERROR sensor busy";
+		}
+	}
+	else if (fields == 3 && strcmp(verb, "ADDRESS") == 0) {
+		char *end;
+		int none = strcmp(arg, "none") == 0;
+		long addr = none ? 0 : strtol(arg, &end, 0);
+		if (!none && (end == arg || *end != '\0' || addr < 0x03 || addr > 0x77)) {
+			error = "ERROR bad address";
+		}
+		else if (!none && AddressInUse(probe, (int)addr)) {
+			error = "ERROR address in use";
+		}
+		else if (!kCollecting) {
+			error = "ERROR not collecting";
+		}
+		else if (RequestControl(probe, CONTROL_ADDRESS, (int)addr) < 0) {
+			error = "ERROR sensor busy";
+		}
+	}
+	else {
+		error = "ERROR bad request";
+	}
+
+	if (error != NULL) {
+		zmq_send(socket, error, strlen(error), 0);
+	}
+	else {
+		zmq_send(socket, "OK", 2, 0);
+	}
+}
+
+
+/*
+ * The request/reply sockets of the program : the resend side channel, the local queries and the control requests.
+ */
+static struct Endpoint kEndpoints[] = {
+	{ RESEND_ENDPOINT, &HandleResendRequest },
+	{ QUERY_ENDPOINT, &HandleQueryRequest },
+	{ CONTROL_ENDPOINT, &HandleControlRequest },
+};
+
+#define ENDPOINT_COUNT (int)(sizeof(kEndpoints) / sizeof(kEndpoints[0]))
+
+
+/*
+ * Wait for wait_ms milli second and answer the requests that arrive on the endpoints in the mean time.
+ * Used instead of delay() between the readings. With 0 it answers the requests already waiting and returns.
+ */
+static void ServiceRequests(int wait_ms) {
+	zmq_pollitem_t items[ENDPOINT_COUNT];
+	uint64_t deadline = NowMs() + wait_ms;
+	uint64_t now;
+	int i;
+
+	for (i = 0; i < ENDPOINT_COUNT; i++) {
+		items[i].socket = kEndpoints[i].socket;
+		items[i].fd = 0;
+		items[i].events = ZMQ_POLLIN;
+	}
+	do {
+		now = NowMs();
+		if (zmq_poll(items, ENDPOINT_COUNT, now < deadline ? (long)(deadline - now) : 0) <= 0) {
+			continue;
+		}
+		for (i = 0; i < ENDPOINT_COUNT; i++) {
+			if (items[i].revents & ZMQ_POLLIN) {
+				kEndpoints[i].handler(kEndpoints[i].socket);
+			}
+		}
+	} while (NowMs() < deadline);
+}
+
+
+/*
+ * Set up the server socket of the data stream on localhost:5556 and the request/reply endpoints.
+ */
+static void OpenStreamSockets(void **context, void **publisher) {
+	int hwm = STREAM_HWM;
+	int i;
+
+	*context = zmq_ctx_new();
+	*publisher = zmq_socket(*context, ZMQ_PUB);
+	zmq_setsockopt(*publisher, ZMQ_SNDHWM, &hwm, sizeof(hwm));
+	int rc = zmq_bind(*publisher, STREAM_ENDPOINT);
+	assert(rc == 0);
+	for (i = 0; i < ENDPOINT_COUNT; i++) {
+		kEndpoints[i].socket = zmq_socket(*context, ZMQ_REP);
+		rc = zmq_bind(kEndpoints[i].socket, kEndpoints[i].address);
+		assert(rc == 0);
+	}
+}
+
+
+/*
+ * Close the sockets opened by OpenStreamSockets.
+ */
+static void CloseStreamSockets(void *context, void *publisher) {
+	int i;
+
+	for (i = 0; i < ENDPOINT_COUNT; i++) {
+		zmq_close(kEndpoints[i].socket);
+		kEndpoints[i].socket = NULL;
+	}
+	zmq_close(publisher);
+	zmq_ctx_destroy(context);
+}
+
+
+/*
+ * Display the time every sensor spent in each power state and the energy it used, estimated from the current
+ * it draws in each state. The energy per sample counts the readings asked again by the fusion as samples.
+ */
+static void DisplayEnergyReport(void) {
+	uint64_t now = NowMs();
+	int i;
+
+	printf("Power saving : %s\n", kPowerSave ? "on" : "off");
+	printf("Sensor  Awake (s)  Reading (s)  Asleep (s)  Energy (J)  Energy/sample (mJ)\n");
+	for (i = 0; i < PROBE_COUNT; i++) {
+		struct Probe *probe = &kProbes[i];
+		double seconds[POWER_STATES];
+		double energy = 0;
+		int state;
+
+		for (state = 0; state < POWER_STATES; state++) {
+			uint64_t ms = probe->power_ms[state];
+			if (state == probe->power_state && kCollecting) {
+				ms += now - probe->power_since;
+			}
+			seconds[state] = ms / 1000.0;
+			energy += seconds[state] * probe->ezo->current_ma[state] / 1000 * SUPPLY_V;
+		}
+		unsigned long samples = probe->samples + probe->rereads;
+		printf("%-6s  %9.1f  %11.1f  %10.1f  %10.3f  %18.2f\n", probe->name, seconds[POWER_IDLE],
+				seconds[POWER_READING], seconds[POWER_ASLEEP], energy, samples > 0 ? energy * 1000 / samples : 0);
+	}
+}
+
+
+/*
+ * Display the scheduling latency of every bus worker, the time between an event being due and the worker
+ * waking up for it.
+ */
+static void DisplayLatencyReport(void) {
+	int i;
+	int bucket;
+
+	printf("Scheduling latency (us) : %s\n", kRealTime ? "real-time mode" : "default priority");
+	for (i = 0; i < BUS_COUNT; i++) {
+		struct Bus *bus = &kBuses[i];
+		printf("Bus %s : wake-ups %lu, mean %llu, max %llu, histogram", bus->device, bus->wakeups,
+				(unsigned long long)(bus->wakeups ? bus->latency_sum_us / bus->wakeups : 0),
+				(unsigned long long)bus->latency_max_us);
+		for (bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+			if (bucket < LATENCY_BUCKETS - 1) {
+				printf(" <=%llu:%lu", (unsigned long long)kLatencyBounds[bucket], bus->latency_histogram[bucket]);
+			}
+			else {
+				printf(" >%llu:%lu", (unsigned long long)kLatencyBounds[bucket - 1], bus->latency_histogram[bucket]);
+			}
+		}
+		printf("\n");
+	}
+}
+
+
+/*
+ * Display the configured and the achieved sampling rate of every sensor and the use of every bus.
+ * Rates are in readings per minute.
+ */
+static void DisplayRateReport(time_t elapsed) {
+	int i;
+
+	if (elapsed <= 0) {
+		elapsed = 1;
+	}
+	printf("\nSensor  Configured/min  Achieved/min  Failed  Late  Skipped  Max late (ms)  Re-reads\n");
+	for (i = 0; i < PROBE_COUNT; i++) {
+		struct Probe *probe = &kProbes[i];
+		printf("%-6s  %14.2f  %12.2f  %6lu  %4lu  %7lu  %13llu  %8lu\n", probe->name, 60000.0 / probe->period_ms,
+				probe->samples * 60.0 / elapsed, probe->failed, probe->late, probe->skipped,
+				(unsigned long long)probe->max_late_ms, probe->rereads);
+	}
+	for (i = 0; i < BUS_COUNT; i++) {
+		printf("Bus %s : %.2f transactions/s of %d allowed\n", kBuses[i].device,
+				(double)kBuses[i].transactions / elapsed, kBuses[i].budget);
+	}
+	DisplayLatencyReport();
+	DisplayEnergyReport();
+	printf("Readings dropped before publishing : %lu\n\n", kSamplesDropped);
+}
+
+
+/*
+ * Take the readings of every sensor and publish them for the given number of seconds, or until the control
+ * endpoint asks to stop. seconds is 0 to collect until then.
+ */
+static void RunCollection(void *publisher, time_t seconds) {
+
+	//Time to keep track of the time for which it records.
+	time_t start_time = time(NULL);
+	time_t end_time = start_time + seconds;
+	time_t collection_start = start_time;
+	time_t next_report = start_time + RATE_REPORT_INTERVAL;
+
+	printf("Data Collection starts at time %s", ctime(&start_time));
+
+	//Every collection is a new epoch of the streams.
+	StartStreams((uint32_t)start_time);
+
+	//The bus workers take the readings of every sensor at its own period.
+	kStopRequested = 0;
+	StartScheduler(NowMs());
+
+	while ((seconds == 0 || start_time < end_time) && !kStopRequested) {
+
+		//Answer the resend, query and control requests while waiting for the readings.
+		ServiceRequests(20);
+
+		//Display and publish the readings taken by the bus workers.
+		DrainSamples(publisher, 1);
+		FlushHeldRows(publisher);
+
+		//Update the time.
+		start_time = time(NULL);
+
+		if (start_time >= next_report) {
+			DisplayRateReport(start_time - collection_start);
+			next_report += RATE_REPORT_INTERVAL;
+		}
+	}
+
+	StopScheduler();
+	DrainSamples(publisher, 1);
+	FlushRows(publisher);
+
+	printf("Data collection ends at time %s", ctime(&start_time));
+	DisplayRateReport(start_time - collection_start);
+	DisplayPublishReport();
+}
 
 
+#ifdef SIMULATED_BUS
 /*
- * Struct type to pass the arguments in the multithreading.
- * channel is the file handler for the device which is used to access the atlas sensor.
- * buffer is the pointer to the string which will hold the data from the atlas senor.
- * type is to identify whether the arguments belong to ph or conductivity.
- * counter is the atlas sensor from which the value is taken.
+ * The footprint of the daemon : resident memory and heap in use in kilo byte, allocations not freed yet,
+ * allocations made since the start and open files.
  */
-struct ReadWriteArg {
-	int channel;
-	char* buffer;
-	char type;
-	int counter;
+struct Footprint {
+	long rss_kb;
+	long heap_kb;
+	long live_allocations;
+	unsigned long allocations;
+	int files;
 };
 
 
 /*
- * Set the I2C Channel 0.
- * Pin 27 - SDA (Data).
- * Pin 28 - SCL (Clock).
- * Sets up the ph sensor on Channel 0.
- * Returns the file handler.
+ * Measure the footprint of the daemon from /proc/self and the allocator.
  */
-static int SetI2cChannel0(int Addr_ph) {
-	return wiringPiI2CSetupInterface("/dev/i2c-0", Addr_ph);
+static void ReadFootprint(struct Footprint *footprint) {
+	long size = 0;
+	long resident = 0;
+
+	FILE *statm = fopen("/proc/self/statm", "r");
+	if (statm != NULL) {
+		if (fscanf(statm, "%ld %ld", &size, &resident) != 2) {
+			resident = 0;
+		}
+		fclose(statm);
+	}
+	footprint->rss_kb = resident * (sysconf(_SC_PAGESIZE) / 1024);
+
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+	struct mallinfo2 heap = mallinfo2();
+#else
+	struct mallinfo heap = mallinfo();
+#endif
+	footprint->heap_kb = (long)(heap.uordblks + heap.hblkhd) / 1024;
+	footprint->live_allocations = SimulatedLiveAllocations();
+	footprint->allocations = SimulatedAllocations();
+
+	footprint->files = 0;
+	DIR *fds = opendir("/proc/self/fd");
+	if (fds != NULL) {
+		while (readdir(fds) != NULL) {
+			footprint->files++;
+		}
+		closedir(fds);
+		//., .. and the handler of the directory itself.
+		footprint->files -= 3;
+	}
 }
 
 
 /*
- * Set the I2C Channel 1.
- * Pin 3 - SDA (Data).
- * Pin 5 - SCL (Clock).
- * Sets up the conductivity sensor on Channel 1.
- * Returns the file handler.
+ * Returns the readings taken by every sensor present, to measure the drift of the next check.
  */
-static int SetI2cChannel1(int Addr_c) {
-	return wiringPiI2CSetupInterface("/dev/i2c-1", Addr_c);
+static void CountReadings(unsigned long *readings) {
+	int i;
+
+	for (i = 0; i < PROBE_COUNT; i++) {
+		readings[i] = kProbes[i].samples + kProbes[i].failed;
+	}
 }
 
 
 /*
- * Write a command to get data from the channel specified.
- * Writes a "R" (0x72) to the atlas sensor.
+ * Returns the largest difference in percent between the readings of a sensor since the last check and the
+ * readings its period asks for over elapsed_ms. The readings are updated for the next check.
  */
-static void WriteData(int channel) {
-	wiringPiI2CWrite(channel, 0x72);
+static double ReadingDrift(unsigned long *readings, uint64_t elapsed_ms) {
+	unsigned long now[PROBE_COUNT];
+	double drift = 0;
+	int i;
+
+	CountReadings(now);
+	for (i = 0; i < PROBE_COUNT; i++) {
+		if (kProbes[i].missing || kProbes[i].paused) {
+			continue;
+		}
+		double expected = (double)elapsed_ms / kProbes[i].period_ms;
+		double difference = fabs((double)(now[i] - readings[i]) - expected) * 100 / expected;
+		if (difference > drift) {
+			drift = difference;
+		}
+		readings[i] = now[i];
+	}
+	return drift;
 }
 
 
 /*
- * Read the data provided by the atlas sensor.
+ * Returns the readings dropped by the queue and the records dropped by the publisher.
  */
-static void ReadData(int channel, char *buffer) {
-	read(channel, buffer, 32);
+static unsigned long DroppedCount(void) {
+	unsigned long dropped = kSamplesDropped;
+	int i;
+
+	for (i = 0; i < kControllerCount; i++) {
+		dropped += kControllers[i].ph.dropped + kControllers[i].cond.dropped;
+	}
+	return dropped;
 }
 
 
 /*
- * Send Data via the socket from the Server.
+ * Returns 1 once the rings of the history of every sensor present are full, so that their memory is all in use.
  */
-static int SendData(void *socket, char *string) {
-	int size = zmq_send(socket, string, strlen(string), 0);
-	return size;
+static int HistoryFull(void) {
+	int i;
+
+	for (i = 0; i < PROBE_COUNT; i++) {
+		struct ProbeHistory *history = &kHistory[i];
+		if (kProbes[i].missing) {
+			continue;
+		}
+		if (history->count < HISTORY_DEPTH || history->rollups[0].count < history->rollups[0].depth ||
+				history->rollups[1].count < history->rollups[1].depth) {
+			return 0;
+		}
+	}
+	return 1;
 }
 
 
 /*
- * Write the data, then the comma, then time stamp to the file nad finally the end of line.
+ * Soak test. Collect for kSoakDays days on the simulated bus, SIMULATED_SPEED times faster than real time, without
+ * displaying the readings, and check the footprint of the daemon every SOAK_CHECK_SECONDS against the thresholds.
+ * Returns 0 if the footprint stayed within the thresholds, -1 otherwise.
  */
-static void WriteDataToFile(char* buffer, char* time, int counter, char type) {
-	//If the counter value is equal to one then we need to write the time as it is the first value in the new row.
-	if (counter == 1) {
-		if (type == 'c') {
-			strcpy(kCloudDataCond, time);
+static int RunSoak(void) {
+	struct Footprint baseline = { 0 };
+	struct Footprint footprint;
+	unsigned long readings[PROBE_COUNT];
+	double max_drift = 0;
+	int have_baseline = 0;
+	int failures = 0;
+	void *context;
+	void *publisher;
+
+	uint64_t start = NowMs();
+	uint64_t end = start + (uint64_t)(kSoakDays * 86400 * 1000);
+	uint64_t last_check = start;
+	uint64_t next_check = start + (uint64_t)SOAK_CHECK_SECONDS * 1000;
+
+	OpenStreamSockets(&context, &publisher);
+	StartStreams((uint32_t)time(NULL));
+	StartScheduler(start);
+	CountReadings(readings);
+
+	printf("\nSoak test of %.1f days, warm up until the history is full.\n", kSoakDays);
+	printf("   Day  RSS (KB)  Heap (KB)  Live allocations  Allocations  Files  Drift (%%)  Skipped  Max late (ms)  Dropped\n");
+	while (NowMs() < end) {
+		ServiceRequests(20);
+		DrainSamples(publisher, 0);
+		FlushHeldRows(publisher);
+
+		uint64_t now = NowMs();
+		if (now < next_check) {
+			continue;
 		}
-		else {
-			strcpy(kCloudDataPh, time);
+
+		unsigned long skipped = 0;
+		uint64_t max_late_ms = 0;
+		int i;
+		for (i = 0; i < PROBE_COUNT; i++) {
+			skipped += kProbes[i].skipped;
+			if (kProbes[i].max_late_ms > max_late_ms) {
+				max_late_ms = kProbes[i].max_late_ms;
+			}
 		}
-	}
-	//If the counter value is equal to three then we need to write the end of file as it is the last value in the current row.
-	if (counter == 3) {
-		if (type == 'c') {
-			strcat(kCloudDataCond, ",");
-			strcat(kCloudDataCond, buffer + 1);
+		double drift = ReadingDrift(readings, now - last_check);
+		unsigned long dropped = DroppedCount();
+		ReadFootprint(&footprint);
+		printf("%6.2f  %8ld  %9ld  %16ld  %11lu  %5d  %9.2f  %7lu  %13llu  %7lu\n", (now - start) / 86400000.0,
+				footprint.rss_kb, footprint.heap_kb, footprint.live_allocations, footprint.allocations, footprint.files,
+				drift, skipped, (unsigned long long)max_late_ms, dropped);
+		fflush(stdout);
+
+		if (drift > max_drift) {
+			max_drift = drift;
 		}
-		else {
-			strcat(kCloudDataPh, ",");
-			strcat(kCloudDataPh, buffer + 1);
+		if (!have_baseline && HistoryFull()) {
+			baseline = footprint;
+			have_baseline = 1;
 		}
+		last_check = now;
+		next_check += (uint64_t)SOAK_CHECK_SECONDS * 1000;
+	}
+
+	StopScheduler();
+	DrainSamples(publisher, 0);
+	FlushRows(publisher);
+	CloseStreamSockets(context, publisher);
+
+	ReadFootprint(&footprint);
+	if (!have_baseline) {
+		printf("FAIL : the soak ended before the warm up.\n");
+		failures++;
 	}
 	else {
-		if (type == 'c') {
-			strcat(kCloudDataCond, ",");
-			strcat(kCloudDataCond, buffer + 1);
+		if (footprint.rss_kb - baseline.rss_kb > SOAK_MAX_RSS_KB) {
+			printf("FAIL : resident memory grew by %ld KB.\n", footprint.rss_kb - baseline.rss_kb);
+			failures++;
 		}
-		else {
-			strcat(kCloudDataPh, ",");
-			strcat(kCloudDataPh, buffer + 1);
+		if (footprint.heap_kb - baseline.heap_kb > SOAK_MAX_HEAP_KB) {
+			printf("FAIL : heap in use grew by %ld KB.\n", footprint.heap_kb - baseline.heap_kb);
+			failures++;
 		}
+		if (footprint.live_allocations - baseline.live_allocations > SOAK_MAX_ALLOCATIONS) {
+			printf("FAIL : %ld more allocations not freed.\n", footprint.live_allocations - baseline.live_allocations);
+			failures++;
+		}
+		if (footprint.files > baseline.files) {
+			printf("FAIL : %d more open files.\n", footprint.files - baseline.files);
+			failures++;
+		}
+	}
+	if (DroppedCount() > 0) {
+		printf("FAIL : %lu readings dropped.\n", DroppedCount());
+		failures++;
+	}
+	if (max_drift > SOAK_MAX_DRIFT) {
+		printf("FAIL : the readings of a sensor drifted by %.2f %% from its period.\n", max_drift);
+		failures++;
 	}
+	printf("Soak test %s.\n", failures == 0 ? "passed" : "failed");
+	return failures == 0 ? 0 : -1;
 }
+#endif
 
 
 /*
- * The function first displays the value in the buffer, then writes the value to the file pointed by fp.
- * The function will display "Still Processing" if the first char of the buffer is a 254.
+ * Ends the headless mode.
  */
-static void DisplayWriteToFile(char* buffer, int counter, char type) {
-	if (buffer[0] == 254) {
-		printf("Still Processing \n\n");
-	}
-	else {
-		time_t timer;
-		char* time_buffer = (char*)calloc(32, sizeof(char));
-		struct tm* tm_info;
-
-		timer = time(NULL);
-		tm_info = localtime(&timer);
-
-		//Time Format : YYYY-MM-DD, HH:MM.
-		strftime(time_buffer, 26, "%Y-%m-%d,%H:%M", tm_info);
-		printf("%s", time_buffer);
-
-		//We require only the first value before comma in conductivity.
-		if (type == 'c') {
-			int loop;
-			for (loop = 0; loop < strlen(buffer); loop++) {
-				if (buffer[loop] == ',') {
-					buffer[loop] = '\0';
-					break;
-				}
-			}
-		}
-
-		printf(" : %s", buffer + 1);
-		WriteDataToFile(buffer, time_buffer, counter, type);
-		printf("\n");
-	}
+static void HandleExitSignal(int signal) {
+	kExiting = 1;
+	kStopRequested = 1;
 }
 
 
 /*
- * The multithreading function which writes a command to request data from the atlas sensor and then read the data and
- * puts it in the buffer. It then display the value and writes it to a file.
+ * Headless mode. The collection starts right away and is then stopped and started again on the control endpoint.
+ * The endpoints stay open between the collections. Runs until SIGINT or SIGTERM.
  */
-static void *ReadWrite(void *arguments) {
-	//Put the arguments in the new struct.
-	struct ReadWriteArg *data = arguments;
-	WriteData(data->channel);
-	delay(800);
-	ReadData(data->channel, data->buffer);
-	DisplayWriteToFile(data->buffer, data->counter, data->type);
+static void RunHeadless(void) {
+	void *context;
+	void *publisher;
+
+	OpenStreamSockets(&context, &publisher);
+	signal(SIGINT, HandleExitSignal);
+	signal(SIGTERM, HandleExitSignal);
+
+	kStartRequested = 1;
+	while (!kExiting) {
+		if (kStartRequested) {
+			kStartRequested = 0;
+			RunCollection(publisher, 0);
+		}
+		else {
+			ServiceRequests(100);
+		}
+	}
+	CloseStreamSockets(context, publisher);
 }
 
 
@@ -240,179 +3468,362 @@ static int KeyBoardHit(void) {
 
 
 /*
- * Used to clear sensor of previous calibration.
+ * Perform one calibration point of the atlas sensor. The readings are displayed until the user sees
+ * a stable reading and presses enter.
+ */
+static void CalibratePoint(int channel, const struct EzoDescriptor *ezo, const struct EzoCalPoint *point) {
+	printf(" Performing %s Calibration for %s \n", point->name, ezo->label);
+	if (point->solution != NULL) {
+		printf(" Please use %s for calibration. \n", point->solution);
+	}
+	printf(" Press enter when you are ready. \n Press enter again on seeing a stable reading to calibrate.\n");
+	getchar();
+	while (!KeyBoardHit()) {
+		char buffer[33] = { 0 };
+		WriteCommand(channel, &ezo->read);
+		delay(ezo->read.delay_ms);
+		ReadData(channel, buffer);
+		printf("%s \n", buffer);
+	}
+	getchar();
+	WriteCommand(channel, &point->command);
+	delay(point->command.delay_ms);
+}
+
+
+/*
+ * Perform the calibration of the atlas sensor in the order of its calibration points, after clearing it.
  * Important to clear the sensor of the previous calibration in order to ensure the new calibration is effective.
+ * For ph : Clear, Mid, Low, High. For conductivity : Clear, Dry, Low, High.
  */
-static void ClearSensor(int channel) {
-	char clear_data[] = "cal,clear";
-	write(channel, clear_data, 9);
-	delay(1000);
+static void Calibrate(int channel, const struct EzoDescriptor *ezo) {
+	int i;
+
+	WriteCommand(channel, &ezo->clear);
+	delay(ezo->clear.delay_ms);
+	for (i = 0; i < ezo->cal_count; i++) {
+		CalibratePoint(channel, ezo, &ezo->cal[i]);
+	}
 }
 
 
 /*
- * Perform the mid calibration of the atlas ph sensor.
+ * Used to check the value read by the sensors.
+ * Does not store the data.
  */
-static void MidCalibrationPh(int channel) {
-	printf(" Performing Midpoint Calibration for ph \n Please use 7.00 ph for calibration. \n Press enter when you are ready. \n Press enter again on seeing a stable reading to calibrate.\n");
-	getchar();
+void DryRun(int channel, const struct EzoDescriptor *ezo) {
+	char buffer[33] = { 0 };
 	while (!KeyBoardHit()) {
-		WriteData(channel);
-		delay(800);
-		char *buffer = (char*)calloc(32, sizeof(char));
-		ReadData(channel, buffer);
-		printf("%s \n", buffer);
+		WriteCommand(channel, &ezo->read);
+		delay(ezo->read.delay_ms);
+		read(channel, buffer, 32);
+		printf("%s\n", buffer);
 	}
 	getchar();
-	char set_cal[] = "cal,mid,7.00";
-	write(channel, set_cal, 12);
-	delay(300);
 }
 
 
 /*
- * Perform the low calibration of the atlas ph sensor.
+ * Parse a line of a native log : "time,controller,stream,epoch,seq,date,time,value1,value2,value3,temperature".
+ * The temperature is missing in the logs written before the compensation.
+ * Returns 1 if the readings of the line were put in the source.
  */
-static void LowCalibrationPh(int channel) {
-	printf(" Performing Lowpoint Calibration for ph \n Please use 4.00 ph for calibration. \n Press enter when you are ready. \n Press enter again on seeing a stable reading to calibrate.\n");
-	getchar();
-	while (!KeyBoardHit()) {
-		WriteData(channel);
-		delay(800);
-		char *buffer = (char*)calloc(32, sizeof(char));
-		ReadData(channel, buffer);
-		printf("%s \n", buffer);
+static int ParseNativeLine(struct ReplaySource *source, char *line) {
+	char *fields[11];
+	int count = 0;
+	int column;
+
+	while (count < 11 && (fields[count] = strsep(&line, ",\r\n")) != NULL) {
+		count++;
 	}
-	getchar();
-	char set_cal[] = "cal,low,4.00";
-	write(channel, set_cal, 12);
-	delay(300);
+	if (count < 10 || (fields[2][0] != 'p' && fields[2][0] != 'c')) {
+		return 0;
+	}
+
+	char type = fields[2][0];
+	float compensation = count > 10 && fields[10][0] != '\0' ? strtof(fields[10], NULL) : NAN;
+	source->time_ms = strtoull(fields[0], NULL, 10);
+	source->pending = 0;
+	for (column = 0; column < 3; column++) {
+		int index = FindProbe(type, column + 1);
+		if (index < 0) {
+			continue;
+		}
+		struct Sample *sample = &source->samples[source->pending++];
+		sample->probe = index;
+		sample->time = (time_t)(source->time_ms / 1000);
+		sample->status = fields[7 + column][0] != '\0' ? 1 : 255;
+		sample->compensation = compensation;
+		snprintf(sample->value, VALUE_SIZE, "%s", fields[7 + column]);
+	}
+	return source->pending > 0;
 }
 
 
 /*
- * Perform the high calibration of the atlas ph sensor.
+ * Parse a line of a log of the bcm2835 program : the response of the sensor, a comma and the ctime of the reading.
+ * The first byte of the response is the status, the value goes up to the first comma.
+ * Returns 1 if the reading of the line was put in the source.
  */
-static void HighCalibrationPh(int channel) {
-	printf(" Performing Highpoint Calibration for ph \n Please use 10.00 ph for calibration. \n Press enter when you are ready. \n Press enter again on seeing a stable reading to calibrate.\n");
-	getchar();
-	while (!KeyBoardHit()) {
-		WriteData(channel);
-		delay(800);
-		char *buffer = (char*)calloc(32, sizeof(char));
-		ReadData(channel, buffer);
-		printf("%s \n", buffer);
+static int ParseBcmLine(struct ReplaySource *source, char *line) {
+	struct tm tm_info;
+	char *time_text = strrchr(line, ',');
+	int index = FindProbe(source->type, 1);
+
+	memset(&tm_info, 0, sizeof(tm_info));
+	if (time_text == NULL || index < 0 || strptime(time_text + 1, "%a %b %d %H:%M:%S %Y", &tm_info) == NULL) {
+		return 0;
 	}
-	getchar();
-	char set_cal[] = "cal,high,10.00";
-	write(channel, set_cal, 13);
-	delay(300);
+	tm_info.tm_isdst = -1;
+
+	struct Sample *sample = &source->samples[0];
+	sample->probe = index;
+	sample->compensation = NAN;
+	sample->time = mktime(&tm_info);
+	sample->status = (unsigned char)line[0];
+	snprintf(sample->value, VALUE_SIZE, "%.*s", (int)strcspn(line + 1, ","), line + 1);
+	source->time_ms = (uint64_t)sample->time * 1000;
+	source->pending = 1;
+	return 1;
 }
 
 
 /*
- * Perform the calibration of atlas ph sensor in the following order:
- * Clear Sensor.
- * Mid Calibration Ph Sensor.
- * Low Calibration Ph Sensor.
- * High Calibration Ph Sensor.
+ * Read the next record of the log into the source. Lines that can not be parsed are skipped.
+ * Returns 1 if there is a record or 0 at the end of the log.
  */
-static void CalibrationPh(int channel) {
-	ClearSensor(channel);
-	MidCalibrationPh(channel);
-	LowCalibrationPh(channel);
-	HighCalibrationPh(channel);
+static int ReadReplayRecord(struct ReplaySource *source) {
+	char line[RECORD_HEADER_SIZE + RECORD_BODY_SIZE + 32];
+
+	source->pending = 0;
+	while (fgets(line, sizeof(line), source->fp) != NULL) {
+		if (source->type == 0 ? ParseNativeLine(source, line) : ParseBcmLine(source, line)) {
+			return 1;
+		}
+	}
+	return 0;
 }
 
 
 /*
- * Perform the dry calibration of the atlas conductivity sensor.
+ * Open a log to replay. A log whose name starts with "data_ph" or "data_c" is a log of the bcm2835 program,
+ * any other is a native log. Returns 0 on success or -1 if the log can not be opened.
  */
-static void DryCalibrationCond(int channel) {
-	printf(" Performing Dry Calibration for conductivity. \n Press enter when you are ready. \n Press enter again on seeing a stable reading to calibrate.\n");
-	getchar();
-	while (!KeyBoardHit()) {
-		WriteData(channel);
-		delay(800);
-		char *buffer = (char*)calloc(32, sizeof(char));
-		ReadData(channel, buffer);
-		printf("%s \n", buffer);
+static int AddReplaySource(const char *path) {
+	const char *name = strrchr(path, '/') != NULL ? strrchr(path, '/') + 1 : path;
+
+	if (kReplaySourceCount == REPLAY_MAX_FILES) {
+		printf("error : at most %d logs can be replayed. \n", REPLAY_MAX_FILES);
+		return -1;
 	}
-	getchar();
-	char set_cal[] = "cal,dry";
-	write(channel, set_cal, 7);
-	delay(800);
+	struct ReplaySource *source = &kReplaySources[kReplaySourceCount];
+	source->fp = fopen(path, "r");
+	if (source->fp == NULL) {
+		printf("error : couldn't open file %s. \n", path);
+		return -1;
+	}
+	if (strncmp(name, "data_ph", 7) == 0) {
+		source->type = 'p';
+	}
+	else if (strncmp(name, "data_c", 6) == 0) {
+		source->type = 'c';
+	}
+	else {
+		source->type = 0;
+	}
+	kReplaySourceCount++;
+	return 0;
 }
 
 
 /*
- * Perform the low calibration of the atlas conductivity sensor.
+ * The replay thread. Merges the logs in time order and puts their readings in the queue of the main thread,
+ * once for every virtual controller. The time between the records is kept, divided by the speed of the replay.
  */
-static void LowCalibrationCond(int channel) {
-	printf(" Performing Lowpoint Calibration for conductivity \n Please use 12900 for calibration. \n Press enter when you are ready. \n Press enter again on seeing a stable reading to calibrate.\n");
-	getchar();
-	while (!KeyBoardHit()) {
-		WriteData(channel);
-		delay(800);
-		char *buffer = (char*)calloc(32, sizeof(char));
-		ReadData(channel, buffer);
-		printf("%s \n", buffer);
+static void *ReplayWorker(void *arguments) {
+	uint64_t start = NowMs();
+	uint64_t first_ms = 0;
+	int i;
+	int j;
+
+	for (i = 0; i < kReplaySourceCount; i++) {
+		ReadReplayRecord(&kReplaySources[i]);
 	}
-	getchar();
-	char set_cal[] = "cal,low,12900";
-	write(channel, set_cal, 13);
-	delay(800);
+
+	for (;;) {
+		//Pick the log with the oldest record.
+		struct ReplaySource *next = NULL;
+		for (i = 0; i < kReplaySourceCount; i++) {
+			if (kReplaySources[i].pending && (next == NULL || kReplaySources[i].time_ms < next->time_ms)) {
+				next = &kReplaySources[i];
+			}
+		}
+		if (next == NULL) {
+			break;
+		}
+
+		if (first_ms == 0) {
+			first_ms = next->time_ms;
+		}
+		if (kReplaySpeed > 0 && next->time_ms > first_ms) {
+			SleepUntilMs(start + (uint64_t)((next->time_ms - first_ms) / kReplaySpeed));
+		}
+
+		for (i = 0; i < kControllerCount; i++) {
+			for (j = 0; j < next->pending; j++) {
+				next->samples[j].controller = i;
+				PushSampleWait(&next->samples[j]);
+			}
+		}
+		kReplayRecords++;
+		ReadReplayRecord(next);
+	}
+
+	kReplayDone = 1;
+	return NULL;
 }
 
 
 /*
- * Perform the high calibration of the atlas conductivity sensor.
+ * Display the throughput of the replay.
  */
-static void HighCalibrationCond(int channel) {
-	printf(" Performing Highpoint Calibration for conductivity \n Please use 50000 for calibration. \n Press enter when you are ready. \n Press enter again on seeing a stable reading to calibrate.\n");
-	getchar();
-	while (!KeyBoardHit()) {
-		WriteData(channel);
-		delay(800);
-		char *buffer = (char*)calloc(32, sizeof(char));
-		ReadData(channel, buffer);
-		printf("%s \n", buffer);
+static void DisplayReplayReport(uint64_t elapsed_ms) {
+	double seconds = elapsed_ms > 0 ? elapsed_ms / 1000.0 : 0.001;
+
+	printf("Replay : %lu records read in %.1f s, %.1f records/s over %d controllers. ", kReplayRecords, seconds,
+			kReplayRecords * kControllerCount / seconds, kControllerCount);
+	DisplayPublishReport();
+}
+
+
+/*
+ * Replay the logs given with -R through the same rows, streams and publisher as the data collection.
+ * The i2c buses are not used.
+ */
+static int RunReplay(void) {
+	void *context;
+	void *publisher;
+	int i;
+
+	//Every virtual controller has its own streams.
+	if (kReplayControllers > 1) {
+		kControllers = (struct Controller*)calloc(kReplayControllers, sizeof(struct Controller));
+		if (kControllers == NULL) {
+			printf("error : not enough memory for %d controllers. \n", kReplayControllers);
+			return -1;
+		}
+		for (i = 0; i < kReplayControllers; i++) {
+			char id[16];
+			snprintf(id, sizeof(id), "V%03d", i + 1);
+			InitController(&kControllers[i], id);
+		}
+		kControllerCount = kReplayControllers;
 	}
-	getchar();
-	char set_cal[] = "cal,high,50000";
-	write(channel, set_cal, 14);
-	delay(800);
+
+	OpenStreamSockets(&context, &publisher);
+	StartStreams((uint32_t)time(NULL));
+
+	uint64_t start = NowMs();
+	uint64_t next_report = start + REPLAY_REPORT_INTERVAL * 1000;
+	pthread_t thread;
+	pthread_create(&thread, NULL, &ReplayWorker, NULL);
+
+	//The requests are answered without waiting, the loop sleeps only while the queue is empty so that -x 0
+	//runs at the speed of the publisher.
+	while (!kReplayDone || kSampleCount > 0) {
+		DrainSamples(publisher, 0);
+		ServiceRequests(0);
+		WaitSample(1);
+		if (NowMs() >= next_report) {
+			DisplayReplayReport(NowMs() - start);
+			next_report += REPLAY_REPORT_INTERVAL * 1000;
+		}
+	}
+
+	pthread_join(thread, NULL);
+	DrainSamples(publisher, 0);
+	FlushRows(publisher);
+	DisplayReplayReport(NowMs() - start);
+
+	CloseStreamSockets(context, publisher);
+	for (i = 0; i < kReplaySourceCount; i++) {
+		fclose(kReplaySources[i].fp);
+	}
+	if (kControllers != &kLocalController) {
+		free(kControllers);
+	}
+	return 0;
 }
 
 
 /*
- * Perform the calibration of the atlas conducitivity sensor in the following order:
- * Clear Sensor.
- * Dry Calibration Cond Sensor.
- * Low Calibration Cond Sensor.
- * High Calibration Cond Sensor.
+ * Turn on the real-time mode for the process.
+ * Locks the current and future memory so the bus workers never page fault, and stops malloc from giving
+ * memory back to the system or serving it from new mappings.
+ * Without the permission to lock the memory, or over RLIMIT_MEMLOCK, the workers still run in real-time
+ * but may page fault.
+ * The queue of the readings is shared by the SCHED_FIFO workers and the main thread, which runs at normal
+ * priority. Its lock inherits the priority of a waiting worker, so the main thread holding it is not preempted
+ * by ordinary work. Called before any thread is started.
  */
-static void CalibrationCond(int channel) {
-	ClearSensor(channel);
-	DryCalibrationCond(channel);
-	LowCalibrationCond(channel);
-	HighCalibrationCond(channel);
+static void EnableRealTime(void) {
+	pthread_mutexattr_t attributes;
+
+	pthread_mutexattr_init(&attributes);
+	if (pthread_mutexattr_setprotocol(&attributes, PTHREAD_PRIO_INHERIT) != 0 ||
+			pthread_mutex_init(&kSampleLock, &attributes) != 0) {
+		printf("error : priority inheritance refused for the queue of the readings. \n");
+	}
+	pthread_mutexattr_destroy(&attributes);
+
+	mallopt(M_TRIM_THRESHOLD, -1);
+	mallopt(M_MMAP_MAX, 0);
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+		printf("error : failed to lock memory (%s). Running without the memory lock.\n", strerror(errno));
+	}
+
+	//Touch the buffers shared with the bus workers.
+	memset(kSampleQueue, 0, sizeof(kSampleQueue));
+	memset(kLocalController.ph.history, 0, sizeof(kLocalController.ph.history));
+	memset(kLocalController.cond.history, 0, sizeof(kLocalController.cond.history));
 }
 
 
 /*
- * Used to check the value read by the sensors.
- * Does not store the data.
+ * Read the cores of the bus workers from a list like "2,3". Returns 0 on success or -1 if the list is invalid.
  */
-void DryRun(int channel) {
-	char *buffer = (char*)calloc(32, sizeof(char));
-	while (!KeyBoardHit()) {
-		WriteData(channel);
-		delay(1000);
-		read(channel, buffer, 32);
-		printf("%s\n", buffer);
+static int ParseCpuList(char *list) {
+	int i;
+	char *token = strtok(list, ",");
+
+	for (i = 0; i < BUS_COUNT && token != NULL; i++) {
+		char *end;
+		long cpu = strtol(token, &end, 10);
+		if (*end != '\0' || cpu < 0 || cpu >= CPU_SETSIZE) {
+			return -1;
+		}
+		kRealTimeCpus[i] = (int)cpu;
+		token = strtok(NULL, ",");
 	}
-	getchar();
+	return token == NULL ? 0 : -1;
+}
+
+
+void DisplayUsage(const char *program) {
+	printf("Usage : %s [-r] [-c cpu0,cpu1] [-p priority] [-s] [-d] [-S days] [-a] [-f csv|json|binary] [-l log] [-R log [-R log ...] [-x speed] [-n controllers]]\n",
+			program);
+	printf(" -r Real-time mode. Bus workers run with SCHED_FIFO and the memory is locked.\n");
+	printf(" -c Core each bus worker is pinned to in real-time mode, one per bus.\n");
+	printf(" -p SCHED_FIFO priority of the bus workers, %d by default.\n", RT_PRIORITY);
+	printf(" -s Power saving. The sensors sleep between their readings.\n");
+	printf(" -d Headless. Collect without the menu, started and stopped on the control endpoint.\n");
+	printf(" -S Soak test on the simulated bus. Collect for the given days and fail if the footprint of the daemon grows.\n");
+	printf(" -a Publish the readings of the three sensors of a type instead of their fusion.\n");
+	printf(" -f Payload of the records : the csv row (default), or the json or binary payload the bridge forwards.\n");
+	printf(" -l Write every published record to a native log.\n");
+	printf(" -R Replay a native log or a data_ph.csv/data_c.csv log instead of reading the sensors.\n");
+	printf(" -x Speed of the replay. 1 is real time, N is N times faster, 0 is as fast as possible.\n");
+	printf(" -n Number of virtual controllers the replay publishes as.\n");
 }
 
 
@@ -470,28 +3881,155 @@ void DisplayDryRunCond(int number) {
 }
 
 
-int main() {
+int main(int argc, char *argv[]) {
+
+	//Read the command line options.
+	int opt;
+	while ((opt = getopt(argc, argv, "rc:p:sdS:af:l:R:x:n:")) != -1) {
+		switch (opt) {
+		case 'r':
+			kRealTime = 1;
+			break;
+		case 'c':
+			if (ParseCpuList(optarg) < 0) {
+				DisplayUsage(argv[0]);
+				return -1;
+			}
+			break;
+		case 'p':
+			kRealTimePriority = atoi(optarg);
+			if (kRealTimePriority < sched_get_priority_min(SCHED_FIFO) ||
+					kRealTimePriority > sched_get_priority_max(SCHED_FIFO)) {
+				DisplayUsage(argv[0]);
+				return -1;
+			}
+			break;
+		case 's':
+			kPowerSave = 1;
+			break;
+		case 'd':
+			kHeadless = 1;
+			break;
+		case 'S':
+			kSoakDays = atof(optarg);
+			if (kSoakDays < SOAK_MIN_DAYS) {
+				printf("error : a soak test runs for at least %.2f days. \n", SOAK_MIN_DAYS);
+				return -1;
+			}
+			break;
+		case 'a':
+			kFusion = 0;
+			break;
+		case 'f':
+			if (strcmp(optarg, "csv") == 0) {
+				kPayload = PAYLOAD_CSV;
+			}
+			else if (strcmp(optarg, "json") == 0) {
+				kPayload = PAYLOAD_JSON;
+			}
+			else if (strcmp(optarg, "binary") == 0) {
+				kPayload = PAYLOAD_BINARY;
+			}
+			else {
+				DisplayUsage(argv[0]);
+				return -1;
+			}
+			break;
+		case 'l':
+			kLogFile = fopen(optarg, "a");
+			if (kLogFile == NULL) {
+				printf("error : couldn't open file %s. \n", optarg);
+				return -1;
+			}
+			break;
+		case 'R':
+			if (AddReplaySource(optarg) < 0) {
+				return -1;
+			}
+			break;
+		case 'x':
+			kReplaySpeed = atof(optarg);
+			if (kReplaySpeed < 0) {
+				DisplayUsage(argv[0]);
+				return -1;
+			}
+			break;
+		case 'n':
+			kReplayControllers = atoi(optarg);
+			if (kReplayControllers < 1) {
+				DisplayUsage(argv[0]);
+				return -1;
+			}
+			break;
+		default:
+			DisplayUsage(argv[0]);
+			return -1;
+		}
+	}
+
+	InitController(&kLocalController, CONTROLLER_ID);
+	InitHistory();
+
+	if (kRealTime) {
+		EnableRealTime();
+	}
+
+	//Replay mode. The logs go through the pipeline instead of the readings of the sensors.
+	if (kReplaySourceCount > 0) {
+		int rc = RunReplay();
+		if (kLogFile != NULL) {
+			fclose(kLogFile);
+		}
+		return rc;
+	}
 
 	//File handler that will be used to read data and write command to the atlas sensor.
-	int channel0_ph1 = SetI2cChannel0(ADDR_PH_1);
-	int channel0_ph2 = SetI2cChannel0(ADDR_PH_2);
-	int channel0_ph3 = SetI2cChannel0(ADDR_PH_3);
-	int channel1_c1 = SetI2cChannel1(ADDR_C_1);
-	int channel1_c2 = SetI2cChannel1(ADDR_C_2);
-	int channel1_c3 = SetI2cChannel1(ADDR_C_3);
-
-	//If channel 0 or channel 1 is -ve then there is an issue with the connection or you are not running as root (Use sudo before execution
-	//of the executable).
-	if (channel0_ph1 < 0 || channel0_ph2 < 0 || channel0_ph3 < 0) {
-		printf("error : failed connection with the I2C channel 0. \n");
-		return -1;
+	int i;
+	for (i = 0; i < PROBE_COUNT; i++) {
+		if (kProbes[i].bus == 0) {
+			kProbes[i].fd = SetI2cChannel0(kProbes[i].addr);
+		}
+		else {
+			kProbes[i].fd = SetI2cChannel1(kProbes[i].addr);
+		}
+
+		//If the file handler is -ve then there is an issue with the connection or you are not running as root (Use sudo before execution
+		//of the executable).
+		if (kProbes[i].fd < 0) {
+			printf("error : failed connection with the I2C channel %d. \n", kProbes[i].bus);
+			return -1;
+		}
 	}
 
-	if (channel1_c1 < 0 || channel1_c2 < 0 || channel1_c3 < 0) {
-		printf("error : failed connection with the I2C channel 1. \n");
+	//Check which sensors answer before the first reading.
+	if (DiscoverProbes() == 0) {
+		printf("error : no sensor answered. \n");
 		return -1;
 	}
 
+	//Soak test without the menu.
+	if (kSoakDays > 0) {
+#ifdef SIMULATED_BUS
+		int rc = RunSoak();
+#else
+		printf("error : the soak test needs a build with -DSIMULATED_BUS. \n");
+		int rc = -1;
+#endif
+		if (kLogFile != NULL) {
+			fclose(kLogFile);
+		}
+		return rc;
+	}
+
+	//Collect without the menu until stopped.
+	if (kHeadless) {
+		RunHeadless();
+		if (kLogFile != NULL) {
+			fclose(kLogFile);
+		}
+		return 0;
+	}
+
 	int option;
 
 	//Print the selection menu until the user presses 0.
@@ -523,17 +4061,17 @@ int main() {
 			printf("\n");
 			if (dummy == 'y' || dummy == 'Y') {
 				DisplayCalibrationPhSensor(1);
-				CalibrationPh(channel0_ph1);
+				Calibrate(kProbes[0].fd, &kEzoPh);
 				DisplayCalibrationPhSensor(2);
-				CalibrationPh(channel0_ph2);
+				Calibrate(kProbes[1].fd, &kEzoPh);
 				DisplayCalibrationPhSensor(3);
-				CalibrationPh(channel0_ph3);
+				Calibrate(kProbes[2].fd, &kEzoPh);
 				DisplayCalibrationCondSensor(1);
-				CalibrationCond(channel1_c1);
+				Calibrate(kProbes[3].fd, &kEzoEc);
 				DisplayCalibrationCondSensor(2);
-				CalibrationCond(channel1_c2);
+				Calibrate(kProbes[4].fd, &kEzoEc);
 				DisplayCalibrationCondSensor(3);
-				CalibrationCond(channel1_c3);
+				Calibrate(kProbes[5].fd, &kEzoEc);
 			}
 			break;
 
@@ -553,32 +4091,32 @@ int main() {
 			case 1:
 				//Calibrate ph sensor 1.
 				DisplayCalibrationPhSensor(1);
-				CalibrationPh(channel0_ph1);
+				Calibrate(kProbes[0].fd, &kEzoPh);
 				break;
 			case 2:
 				//Calibrate ph sensor 2.
 				DisplayCalibrationPhSensor(2);
-				CalibrationPh(channel0_ph2);
+				Calibrate(kProbes[1].fd, &kEzoPh);
 				break;
 			case 3:
 				//Calibrate ph sensor 3.
 				DisplayCalibrationPhSensor(3);
-				CalibrationPh(channel0_ph3);
+				Calibrate(kProbes[2].fd, &kEzoPh);
 				break;
 			case 4:
 				//Calibrate conductivity sensor 1.
 				DisplayCalibrationCondSensor(1);
-				CalibrationCond(channel1_c1);
+				Calibrate(kProbes[3].fd, &kEzoEc);
 				break;
 			case 5:
 				//Calibrate conductivity sensor 2.
 				DisplayCalibrationCondSensor(2);
-				CalibrationCond(channel1_c2);
+				Calibrate(kProbes[4].fd, &kEzoEc);
 				break;
 			case 6:
 				//Calibrate conductivity sensor 3.
 				DisplayCalibrationPhSensor(3);
-				CalibrationCond(channel1_c3);
+				Calibrate(kProbes[5].fd, &kEzoEc);
 				break;
 			default:
 				//Invalid Option Case.
@@ -599,32 +4137,32 @@ int main() {
 			case 1:
 				//Dry run ph sensor 1.
 				DisplayDryRunPh(1);
-				DryRun(channel0_ph1);
+				DryRun(kProbes[0].fd, kProbes[0].ezo);
 				break;
 			case 2:
 				//Calibrate ph sensor 2.
 				DisplayDryRunPh(2);
-				DryRun(channel0_ph2);
+				DryRun(kProbes[1].fd, kProbes[1].ezo);
 				break;
 			case 3:
 				//Calibrate ph sensor 3.
 				DisplayDryRunPh(3);
-				DryRun(channel0_ph3);
+				DryRun(kProbes[2].fd, kProbes[2].ezo);
 				break;
 			case 4:
 				//Calibrate conductivity sensor 1.
 				DisplayDryRunCond(1);
-				DryRun(channel1_c1);
+				DryRun(kProbes[3].fd, kProbes[3].ezo);
 				break;
 			case 5:
 				//Calibrate conductivity sensor 2.
 				DisplayDryRunCond(2);
-				DryRun(channel1_c2);
+				DryRun(kProbes[4].fd, kProbes[4].ezo);
 				break;
 			case 6:
 				//Calibrate conductivity sensor 1.
 				DisplayDryRunCond(3);
-				DryRun(channel1_c3);
+				DryRun(kProbes[5].fd, kProbes[5].ezo);
 				break;
 			default:
 				printf("Invalid option \n");
@@ -638,112 +4176,21 @@ int main() {
 			}
 
 			getchar();
-			printf("Creating buffer for data input\n");
-
-			//Create pointer to the buffer that will hold the data returned from the atlas sensor.
-			char *buffer_ph;
-			char *buffer_c;
 
-			buffer_ph = (char*)calloc(32, sizeof(char));
-			buffer_c = (char*)calloc(32, sizeof(char));
-
-			//Set up server to socket localhost:5556.
-			void *context = zmq_ctx_new();
-			void *publisher = zmq_socket(context, ZMQ_PUB);
-			int rc = zmq_bind(publisher, "tcp://*:5556");
-			assert(rc == 0);
-
-			//Create threads used to multithread.
-			pthread_t thread_ph;
-			pthread_t thread_c;
-
-			//Create the structure to pass the data for ph in multithreading.
-			struct ReadWriteArg ph_data;
-			ph_data.buffer = buffer_ph;
-			ph_data.type = 'p';
-
-			//Create the structure to pass the data for conductivity in multithreading.
-			struct ReadWriteArg c_data;
-			c_data.buffer = buffer_c;
-			c_data.type = 'c';
-
-			//Time to keep track of the time for which it records.
-			time_t end_time;
-			time_t start_time = time(NULL);
+			//Set up server to socket localhost:5556, the resend side channel to localhost:5557, the
+			//local queries to localhost:5558 and the control requests to localhost:5559.
+			void *context;
+			void *publisher;
+			OpenStreamSockets(&context, &publisher);
 
 			//4 hours = 4 * 60 min = 4 * 60 * 60 seconds = 14400 seconds.
 			//4.5 hours = 16200 seconds.
 			//30 min = 30 * 60 = 1800 seconds.
 			//1 hour = 60 * 60 = 3600 seconds.
 			time_t seconds = 14400;
+			RunCollection(publisher, seconds);
 
-			end_time = start_time + seconds;
-			printf("Data Collection starts at time %s", ctime(&start_time));
-			//
-
-			while (start_time < end_time) {
-
-				kCloudDataPh = (char*)calloc(254, sizeof(char));
-				kCloudDataCond = (char*)calloc(254, sizeof(char));
-
-				//Reading Pair 1.
-				ph_data.channel = channel0_ph1;
-				ph_data.counter = 1;
-				c_data.channel = channel1_c1;
-				c_data.counter = 1;
-
-				//Create the thread and run them.
-				pthread_create(&thread_ph, NULL, &ReadWrite, (void *)&ph_data);
-				pthread_create(&thread_c, NULL, &ReadWrite, (void *)&c_data);
-
-				//Wait for the thread to finish.
-				pthread_join(thread_ph, NULL);
-				pthread_join(thread_c, NULL);
-
-				//Reading Pair 2.
-				ph_data.channel = channel0_ph2;
-				ph_data.counter = 2;
-				c_data.channel = channel1_c2;
-				c_data.counter = 2;
-
-				//Create the thread and run them.
-				pthread_create(&thread_ph, NULL, &ReadWrite, (void *)&ph_data);
-				pthread_create(&thread_c, NULL, &ReadWrite, (void *)&c_data);
-
-				//Wait for the thread to finish.
-				pthread_join(thread_ph, NULL);
-				pthread_join(thread_c, NULL);
-
-				//Reading the Pair 3.
-				ph_data.channel = channel0_ph3;
-				ph_data.counter = 3;
-				c_data.channel = channel1_c3;
-				c_data.counter = 3;
-
-				//Create the thread and run them.
-				pthread_create(&thread_ph, NULL, &ReadWrite, (void *)&ph_data);
-				pthread_create(&thread_c, NULL, &ReadWrite, (void *)&c_data);
-
-				//Wait for the thread to finish.
-				pthread_join(thread_ph, NULL);
-				pthread_join(thread_c, NULL);
-
-				SendData(publisher, kCloudDataPh);
-				SendData(publisher, kCloudDataCond);
-				printf("\n");
-
-				//Delay between the readings.
-				delay(DEL);
-
-				//Update the time.
-				start_time = time(NULL);
-
-			}
-
-			printf("Data collection ends at time %s", ctime(&start_time));
-
-			zmq_close(publisher);
-			zmq_ctx_destroy(context);
+			CloseStreamSockets(context, publisher);
 
 			break;
 
@@ -752,5 +4199,8 @@ int main() {
 		}
 	} while (option != 0);
 
+	if (kLogFile != NULL) {
+		fclose(kLogFile);
+	}
 	return 0;
 }
@@ -0,0 +1,169 @@
+# encoding=utf8
+"""Subscriber side of the sequence numbered data stream.
+
+Every record published by i2c_atlas_sensor_data is a two frame message. The
+first frame is the header "controller,stream,epoch,seq" and the second frame
+is the body. The sequence number starts from 1 in every epoch and grows by one
+per record, so a missing or reordered record shows up as a gap.
+
+The body is the csv row, or the json or binary payload the daemon builds with
+-f for the bridge to forward as it is. decode_binary() reads the binary one.
+
+SequencedSubscriber hides the gaps from the application. When a gap is seen it
+asks the publisher for the missing range on the resend side channel and hands
+the records over in order. Records the publisher no longer keeps are reported
+through the on_lost callback instead of being silently skipped.
+"""
+import struct
+import zmq
+
+# Default endpoints of the data stream and of the resend side channel.
+STREAM_ENDPOINT = 'tcp://localhost:5556'
+RESEND_ENDPOINT = 'tcp://localhost:5557'
+
+# Time to wait for a reply on the side channel, in milli second.
+RESEND_TIMEOUT = 1000
+
+
+class Record(object):
+    """One record of the stream. payload is the body frame as bytes."""
+    def __init__(self, controller, stream, epoch, seq, payload):
+        self.controller = controller
+        self.stream = stream
+        self.epoch = epoch
+        self.seq = seq
+        self.payload = payload
+
+    @property
+    def body(self):
+        '''The body as text, for the csv and json payloads.'''
+        return self.payload.decode('ascii')
+
+
+def parse_record(header, body):
+    '''Build a Record from the header and body frames.'''
+    controller, stream, epoch, seq = header.decode('ascii').split(',')
+    return Record(controller, stream, int(epoch), int(seq), body)
+
+
+# Version of the binary payload and the layout of its fixed part:
+# version, type, form, columns, time, temperature.
+BINARY_VERSION = 1
+BINARY_HEAD = struct.Struct('<BcBBIf')
+
+
+def decode_binary(payload):
+    '''Decode a binary payload into a dict. A fused row has value and confidence, a raw row
+       has values. Empty readings and a missing temperature are NaN.'''
+    version, kind, form, columns, time, temperature = BINARY_HEAD.unpack_from(payload)
+    if version != BINARY_VERSION:
+        raise ValueError('unknown payload version {}'.format(version))
+    offset = BINARY_HEAD.size
+    length = bytearray(payload[offset:offset + 1])[0]
+    controller = payload[offset + 1:offset + 1 + length].decode('ascii')
+    offset += 1 + length
+    row = {'controller_id': controller, 'type': kind.decode('ascii'), 'columns': columns, 'timestamp': time,
+           'temperature': temperature}
+    if form == 1:
+        row['value'], row['confidence'] = struct.unpack_from('<ff', payload, offset)
+    else:
+        row['values'] = struct.unpack_from('<fff', payload, offset)
+    return row
+
+
+class GapTracker(object):
+    """Track the next expected sequence number of every stream.
+
+    check() returns the range (first, last) of records missing before the
+    given record, None if the record is the next one expected, or 'old' if it
+    has already been seen or belongs to an earlier epoch. A new epoch restarts
+    the stream from 1, so the records of the new epoch before the first one
+    seen are missing, unless it is the first epoch seen of the stream."""
+    def __init__(self):
+        self.expected = {}
+
+    def check(self, record):
+        key = (record.controller, record.stream)
+        epoch, seq = self.expected.get(key, (None, None))
+        if epoch is None:
+            # First record of the stream. Nothing before it is known to be missing.
+            self.expected[key] = (record.epoch, record.seq + 1)
+            return None
+        if record.epoch < epoch:
+            return 'old'
+        if record.epoch > epoch:
+            # Restart of the publisher. The new epoch starts from 1.
+            epoch, seq = record.epoch, 1
+        if record.seq < seq:
+            return 'old'
+        self.expected[key] = (epoch, record.seq + 1)
+        if record.seq > seq:
+            return (seq, record.seq - 1)
+        return None
+
+
+class SequencedSubscriber(object):
+    """SUB socket on the data stream with gap detection and resend."""
+    def __init__(self, context, stream_endpoint=STREAM_ENDPOINT, resend_endpoint=RESEND_ENDPOINT,
+                 topic='', on_lost=None):
+        self.context = context
+        self.resend_endpoint = resend_endpoint
+        self.on_lost = on_lost
+        self.tracker = GapTracker()
+        self.pending = []
+        self.socket = context.socket(zmq.SUB)
+        self.socket.connect(stream_endpoint)
+        self.socket.setsockopt(zmq.SUBSCRIBE, topic.encode('ascii'))
+        self.resend = None
+
+    def _resend_socket(self):
+        '''Lazily connect the REQ socket of the side channel.'''
+        if self.resend is None:
+            self.resend = self.context.socket(zmq.REQ)
+            self.resend.setsockopt(zmq.LINGER, 0)
+            self.resend.connect(self.resend_endpoint)
+        return self.resend
+
+    def _lost(self, record, first, last):
+        if self.on_lost is not None:
+            self.on_lost(record.controller, record.stream, record.epoch, first, last)
+
+    def request_resend(self, record, first, last):
+        '''Ask the publisher for the records first..last of the stream of record.
+           Returns the records received, in order, and reports the ones that are lost.'''
+        socket = self._resend_socket()
+        socket.send_string('RESEND {} {} {} {} {}'.format(record.controller, record.stream, record.epoch, first, last))
+        if not socket.poll(RESEND_TIMEOUT):
+            # A REQ socket without a reply can not be used again. Drop it and start over next time.
+            socket.close()
+            self.resend = None
+            self._lost(record, first, last)
+            return []
+        frames = socket.recv_multipart()
+        status = frames[0].decode('ascii').split()
+        if status[0] != 'OK':
+            self._lost(record, first, last)
+            return []
+        kept_first, kept_last = int(status[1]), int(status[2])
+        if kept_first > first:
+            self._lost(record, first, min(kept_first - 1, last))
+        if kept_last < last:
+            self._lost(record, max(kept_last + 1, first), last)
+        return [parse_record(frames[i], frames[i + 1]) for i in range(1, len(frames) - 1, 2)]
+
+    def recv(self):
+        '''Return the next record of the stream. Missing records are fetched on the side channel
+           and returned before the record that revealed the gap.'''
+        if self.pending:
+            return self.pending.pop(0)
+        while True:
+            header, body = self.socket.recv_multipart()
+            record = parse_record(header, body)
+            gap = self.tracker.check(record)
+            if gap == 'old':
+                continue
+            if gap is not None:
+                self.pending = self.request_resend(record, gap[0], gap[1])
+                self.pending.append(record)
+                return self.pending.pop(0)
+            return record
@@ -0,0 +1,365 @@
+/*
+ * Simulated i2c bus and atlas EZO sensors for the soak test of i2c_atlas_sensor_data.
+ * See simulated_bus.h. The type of a sensor is chosen from its address, as in the kProbes table.
+ */
+
+
+#define _GNU_SOURCE
+#define SIMULATED_BUS_INTERNAL
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <stdarg.h>
+#include "simulated_bus.h"
+
+
+/*
+ * Speed of the simulated clock. 1000 runs 30 days of sampling in about 43 minutes.
+ */
+#ifndef SIMULATED_SPEED
+#define SIMULATED_SPEED 1000
+#endif
+
+
+/*
+ * Time a simulated sensor needs to take a reading and to answer the other commands, in milli second of the
+ * simulated clock. Shorter than the delays of the descriptors so that the daemon finds the answer ready.
+ */
+#define SIMULATED_READING_MS 400
+#define SIMULATED_COMMAND_MS 100
+
+
+/*
+ * Highest file handler a simulated sensor can have.
+ */
+#define SIMULATED_MAX_FD 1024
+
+
+/*
+ * A simulated sensor. device is its answer to "i", value and noise the mean and spread of its readings.
+ * response is the answer to the last command, ready at ready_us, with length 0 if there is none.
+ */
+struct Board {
+	const char *device;
+	double value;
+	double noise;
+	int asleep;
+	unsigned int seed;
+	uint64_t ready_us;
+	char response[32];
+	int length;
+};
+
+
+/*
+ * The type of the simulated sensor at every address of the kProbes table, and a DO and an ORP sensor at the free
+ * addresses 0x69 and 0x6a. The ADDRESS control command can move a column to them, they answer "i" with the device
+ * of their data sheet.
+ */
+struct BoardType {
+	int first;
+	int last;
+	const char *device;
+	double value;
+	double noise;
+};
+
+static const struct BoardType kBoardTypes[] = {
+	{ 0x61, 0x63, "pH", 7.0, 0.02 },
+	{ 0x64, 0x66, "EC", 12000, 20 },
+	{ 0x67, 0x68, "RTD", 20.5, 0.3 },
+	{ 0x69, 0x69, "D.O.", 8.2, 0.05 },
+	{ 0x6a, 0x6a, "ORP", 225, 2 },
+};
+
+#define BOARD_TYPE_COUNT (int)(sizeof(kBoardTypes) / sizeof(kBoardTypes[0]))
+
+static struct Board *kBoards[SIMULATED_MAX_FD];
+static pthread_mutex_t kBoardLock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_once_t kClockOnce = PTHREAD_ONCE_INIT;
+static uint64_t kOriginUs;
+static uint64_t kWallOriginUs;
+
+
+/*
+ * Allocations made and not freed yet, and all the allocations made, by the program and its libraries.
+ * malloc() and the others below count them and use the allocator of the C library.
+ */
+static long kLiveAllocations;
+static unsigned long kAllocations;
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *pointer, size_t size);
+extern void __libc_free(void *pointer);
+
+
+static void CountAllocation(void *pointer) {
+	if (pointer != NULL) {
+		__atomic_add_fetch(&kLiveAllocations, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&kAllocations, 1, __ATOMIC_RELAXED);
+	}
+}
+
+
+void *malloc(size_t size) {
+	void *pointer = __libc_malloc(size);
+	CountAllocation(pointer);
+	return pointer;
+}
+
+
+void *calloc(size_t count, size_t size) {
+	void *pointer = __libc_calloc(count, size);
+	CountAllocation(pointer);
+	return pointer;
+}
+
+
+void *realloc(void *pointer, size_t size) {
+	void *moved = __libc_realloc(pointer, size);
+	if (pointer == NULL) {
+		CountAllocation(moved);
+	}
+	else if (size == 0) {
+		__atomic_sub_fetch(&kLiveAllocations, 1, __ATOMIC_RELAXED);
+	}
+	return moved;
+}
+
+
+void free(void *pointer) {
+	if (pointer != NULL) {
+		__atomic_sub_fetch(&kLiveAllocations, 1, __ATOMIC_RELAXED);
+	}
+	__libc_free(pointer);
+}
+
+
+/*
+ * Returns the allocations not freed yet and the allocations made since the start.
+ */
+long SimulatedLiveAllocations(void) {
+	return __atomic_load_n(&kLiveAllocations, __ATOMIC_RELAXED);
+}
+
+unsigned long SimulatedAllocations(void) {
+	return __atomic_load_n(&kAllocations, __ATOMIC_RELAXED);
+}
+
+
+/*
+ * Returns the time of the given real clock in micro second.
+ */
+static uint64_t RealUs(clockid_t clock) {
+	struct timespec now;
+	clock_gettime(clock, &now);
+	return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+
+/*
+ * The simulated clocks start from the real ones at the first call.
+ */
+static void StartClock(void) {
+	kOriginUs = RealUs(CLOCK_MONOTONIC);
+	kWallOriginUs = RealUs(CLOCK_REALTIME);
+}
+
+
+/*
+ * Returns the time of the simulated monotonic clock in micro second.
+ */
+uint64_t SimulatedNowUs(void) {
+	pthread_once(&kClockOnce, StartClock);
+	return kOriginUs + (RealUs(CLOCK_MONOTONIC) - kOriginUs) * SIMULATED_SPEED;
+}
+
+
+/*
+ * Returns the time of the simulated wall clock in micro second.
+ */
+uint64_t SimulatedWallUs(void) {
+	pthread_once(&kClockOnce, StartClock);
+	return kWallOriginUs + (RealUs(CLOCK_MONOTONIC) - kOriginUs) * SIMULATED_SPEED;
+}
+
+
+/*
+ * time() on the simulated wall clock.
+ */
+time_t SimulatedTime(time_t *t) {
+	time_t now = (time_t)(SimulatedWallUs() / 1000000);
+	if (t != NULL) {
+		*t = now;
+	}
+	return now;
+}
+
+
+/*
+ * Sleep until the simulated monotonic clock reaches when, in micro second.
+ */
+void SimulatedSleepUntilUs(uint64_t when) {
+	struct timespec until;
+
+	pthread_once(&kClockOnce, StartClock);
+	uint64_t real = when > kOriginUs ? kOriginUs + (when - kOriginUs) / SIMULATED_SPEED : kOriginUs;
+	until.tv_sec = real / 1000000;
+	until.tv_nsec = (real % 1000000) * 1000;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) == EINTR) {
+	}
+}
+
+
+/*
+ * delay() of wiringPi on the simulated clock.
+ */
+void delay(unsigned int howLong) {
+	SimulatedSleepUntilUs(SimulatedNowUs() + (uint64_t)howLong * 1000);
+}
+
+
+/*
+ * Open a simulated sensor at the address. Returns its file handler or -1 if there is no sensor at the address.
+ */
+int wiringPiI2CSetupInterface(const char *device, int devId) {
+	int i;
+
+	for (i = 0; i < BOARD_TYPE_COUNT && (devId < kBoardTypes[i].first || devId > kBoardTypes[i].last); i++) {
+	}
+	if (i == BOARD_TYPE_COUNT) {
+		return -1;
+	}
+	int fd = open("/dev/null", O_RDWR);
+	if (fd < 0 || fd >= SIMULATED_MAX_FD) {
+		if (fd >= 0) {
+			close(fd);
+		}
+		return -1;
+	}
+
+	struct Board *board = (struct Board*)calloc(1, sizeof(struct Board));
+	if (board == NULL) {
+		close(fd);
+		return -1;
+	}
+	board->device = kBoardTypes[i].device;
+	board->value = kBoardTypes[i].value;
+	board->noise = kBoardTypes[i].noise;
+	board->seed = (unsigned int)devId;
+	pthread_mutex_lock(&kBoardLock);
+	kBoards[fd] = board;
+	pthread_mutex_unlock(&kBoardLock);
+	return fd;
+}
+
+
+/*
+ * close() on a simulated sensor frees it, or on any other file handler closes it.
+ */
+int SimulatedClose(int fd) {
+	if (fd >= 0 && fd < SIMULATED_MAX_FD && kBoards[fd] != NULL) {
+		pthread_mutex_lock(&kBoardLock);
+		free(kBoards[fd]);
+		kBoards[fd] = NULL;
+		pthread_mutex_unlock(&kBoardLock);
+	}
+	return close(fd);
+}
+
+
+/*
+ * Set the answer of the sensor to the last command, ready delay_ms from now.
+ */
+static void Respond(struct Board *board, int delay_ms, const char *format, ...) {
+	va_list args;
+
+	board->response[0] = 1;
+	va_start(args, format);
+	int length = vsnprintf(board->response + 1, sizeof(board->response) - 1, format, args);
+	va_end(args);
+	board->length = length < (int)sizeof(board->response) - 1 ? length + 1 : (int)sizeof(board->response);
+	board->ready_us = SimulatedNowUs() + (uint64_t)delay_ms * 1000;
+}
+
+
+/*
+ * A command written to a sensor. A sleeping sensor wakes up and drops the command, like the EZO boards.
+ */
+static void RunCommand(struct Board *board, const char *command, size_t count) {
+	char text[32];
+
+	snprintf(text, sizeof(text), "%.*s", (int)count, command);
+	board->length = 0;
+	if (board->asleep) {
+		board->asleep = 0;
+		return;
+	}
+	if (strcasecmp(text, "R") == 0 || strncasecmp(text, "RT,", 3) == 0) {
+		double spread = ((double)rand_r(&board->seed) / RAND_MAX * 2 - 1) * board->noise;
+		Respond(board, SIMULATED_READING_MS, "%.3f", board->value + spread);
+	}
+	else if (strcasecmp(text, "i") == 0) {
+		Respond(board, SIMULATED_COMMAND_MS, "?I,%s,2.10", board->device);
+	}
+	else if (strcasecmp(text, "Sleep") == 0) {
+		board->asleep = 1;
+	}
+	else {
+		Respond(board, SIMULATED_COMMAND_MS, "");
+	}
+}
+
+
+/*
+ * read() on a simulated sensor gives the answer to the last command, or on any other file handler reads it.
+ */
+ssize_t SimulatedRead(int fd, void *buffer, size_t count) {
+	struct Board *board = fd >= 0 && fd < SIMULATED_MAX_FD ? kBoards[fd] : NULL;
+
+	if (board == NULL) {
+		return read(fd, buffer, count);
+	}
+	memset(buffer, 0, count);
+	if (board->length == 0) {
+		((unsigned char*)buffer)[0] = 255;
+	}
+	else if (SimulatedNowUs() < board->ready_us) {
+		((unsigned char*)buffer)[0] = 254;
+	}
+	else {
+		memcpy(buffer, board->response, (size_t)board->length < count ? (size_t)board->length : count);
+		board->length = 0;
+	}
+	return count;
+}
+
+
+/*
+ * write() on a simulated sensor runs the command, or on any other file handler writes it.
+ */
+ssize_t SimulatedWrite(int fd, const void *buffer, size_t count) {
+	struct Board *board = fd >= 0 && fd < SIMULATED_MAX_FD ? kBoards[fd] : NULL;
+
+	if (board == NULL) {
+		return write(fd, buffer, count);
+	}
+	RunCommand(board, (const char*)buffer, count);
+	return count;
+}
+
+
+/*
+ * wiringPiI2CWrite() writes a single byte command.
+ */
+int wiringPiI2CWrite(int fd, int data) {
+	char command = (char)data;
+	return (int)SimulatedWrite(fd, &command, 1);
+}
@@ -0,0 +1,43 @@
+/*
+ * simulated_bus.h
+ *
+ * Simulated i2c bus and atlas EZO sensors, used instead of wiringPi when i2c_atlas_sensor_data.c is compiled
+ * with -DSIMULATED_BUS. It runs the daemon without the hardware, on a clock SIMULATED_SPEED times faster than
+ * the real one, for the soak test (-S).
+ *
+ * A sensor is a real file handler on /dev/null, so the file handlers of the daemon are counted as on the hardware,
+ * and read() and write() on it answer like an EZO board : "R", "RT,...", "i", "Sleep", "cal,..." and the
+ * 254 (still processing) and 255 (no data) status. Include it after the system headers, it replaces
+ * read(), write(), close() and time() in the file that includes it.
+ * The allocations of the program are counted for the soak test.
+ */
+#ifndef SIMULATED_BUS_H
+#define SIMULATED_BUS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <time.h>
+
+int wiringPiI2CSetupInterface(const char *device, int devId);
+int wiringPiI2CWrite(int fd, int data);
+void delay(unsigned int howLong);
+
+ssize_t SimulatedRead(int fd, void *buffer, size_t count);
+ssize_t SimulatedWrite(int fd, const void *buffer, size_t count);
+int SimulatedClose(int fd);
+time_t SimulatedTime(time_t *t);
+uint64_t SimulatedNowUs(void);
+uint64_t SimulatedWallUs(void);
+void SimulatedSleepUntilUs(uint64_t when);
+long SimulatedLiveAllocations(void);
+unsigned long SimulatedAllocations(void);
+
+#ifndef SIMULATED_BUS_INTERNAL
+#define read(fd, buffer, count) SimulatedRead(fd, buffer, count)
+#define write(fd, buffer, count) SimulatedWrite(fd, buffer, count)
+#define close(fd) SimulatedClose(fd)
+#define time(t) SimulatedTime(t)
+#endif
+
+#endif
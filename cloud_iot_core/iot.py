@@ -13,6 +13,14 @@ import thread
 import threading
 import time
 
+# Calibration points of the atlas sensors : the value of the calibration solution and the point it calibrates.
+# This deployment calibrates its boards directly and keeps its own points, they are not the ones of the kEzo* tables
+# of i2c_atlas_sensor_data.c (the EC high point is 30100 here and 50000 there).
+CAL_POINTS = {
+    'PH': {'7.00': 'MID', '4.00': 'LOW', '10.00': 'HIGH'},
+    'EC': {'12900': 'LOW', '30100': 'HIGH'},
+}
+
 class AtlasI2C:
     # the timeout needed to query readings and calibrations
     long_timeout = .8
@@ -213,31 +221,31 @@ class Device(object):
         # For calibration
         if data['message'] == 'Calibrate Data':
             # Start new thread for calibration since callback are thread blocking. 
+            value = data['value']
             if data['type'] == 'PH':
                 # Handle ph caliration
-                value = data['value']
                 if data['device'] == 'ph1':
                     # Send calibrate value to ph1
-                    thread.start_new_thread(self.calibrate_ph, (self.device_1,value,))
+                    thread.start_new_thread(self.calibrate, (self.device_1, 'PH', value,))
                 elif data['device'] == 'ph2':
                     # Send calibrate value to ph2
-                    thread.start_new_thread(self.calibrate_ph, (self.device_4, value,))
+                    thread.start_new_thread(self.calibrate, (self.device_4, 'PH', value,))
                 elif data['device'] == 'ph3':
                     # Send calibrate value to ph3
-                    thread.start_new_thread(self.calibrate_ph, (self.device_5, value,))
+                    thread.start_new_thread(self.calibrate, (self.device_5, 'PH', value,))
                 else:
                     print 'Illegal device id for ph'
             elif data['type'] == 'EC':
                 # Handle ec calibration
                 if data['device'] == 'ec1':
                     # Send calibrate value to ec1
-                    thread.start_new_thread(self.calibrate_ec, (self.device_6, value,))
+                    thread.start_new_thread(self.calibrate, (self.device_6, 'EC', value,))
                 elif data['device'] == 'ec2':
                     # Send calibrate value to ec2
-                    thread.start_new_thread(self.calibrate_ec, (self.device_2, value,))
+                    thread.start_new_thread(self.calibrate, (self.device_2, 'EC', value,))
                 elif data['device'] == 'ec3':
                     # Send calibrate value to ec3
-                    thread.start_new_thread(self.calibrate_ec, (self.device_3, value,))
+                    thread.start_new_thread(self.calibrate, (self.device_3, 'EC', value,))
                 else:
                     print 'Illegal device id for ec'
         elif data['message'] == 'Data Collection':
@@ -252,43 +260,15 @@ class Device(object):
             print 'Illegal message'
         return
 
-    def calibrate_ph(self, device, value):
-        '''Handle the MID, LOW, HIGH based on value
+    def calibrate(self, device, probe_type, value):
+        '''Calibrate the point of CAL_POINTS given by the value of the calibration solution.
            Send the reading of the probe to the calibrartion tube for the user to see the trend.
            Issue the command after 2 minutes since value usually stabilize after that time.'''
-        command = 'CAL,'
-        if value == '7.00':
-            command = command + 'MID,' + value
-        elif value == '4.00':
-            command = command + 'LOW,' + value
-        elif value == '10.00':
-            command = command + 'HIGH,' + value
-        else:
-            print 'Illegal Value for ph'
-            return
-        print command
-        intial_time = datetime.datetime.utcnow()
-        while ((datetime.datetime.utcnow() - intial_time).seconds <= 120):
-            payload = device.query("R")
-            print payload
-            self.client.publish(self.calibration_topic, payload, qos=1)
-            # This will be send to pub sub.
-        # 2 minutes have expired
-        status = device.query(command)
-        print status
-
-    def calibrate_ec(self, device, value):
-        '''Handle the MID, LOW, HIGH based on value
-           Send the reading of the probe to the calibrartion tube for the user to see the trend.
-           Issue the command after 2 minutes since value usually stabilize after that time.'''
-        command = 'CAL,'
-        if value == '12900':
-            command = command + 'LOW,' + value
-        elif value == '30100':
-            command = command + 'HIGH,' + value
-        else:
-            print 'Illegal Value for ph'
+        point = CAL_POINTS[probe_type].get(value)
+        if point is None:
+            print 'Illegal Value for {}'.format(probe_type.lower())
             return
+        command = 'CAL,' + point + ',' + value
         print command
         intial_time = datetime.datetime.utcnow()
         while ((datetime.datetime.utcnow() - intial_time).seconds <= 120):